@@ -4,9 +4,20 @@
  * 2002-10-20  Barry Pederson <bp@barryp.org>
  *
  */
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include <Python.h>
+#include <marshal.h>
 #include "local_scan.h"
 
 /* ---- Settings controllable at runtime through Exim 'configure' file --------
@@ -42,21 +53,51 @@
 
 */
 
+static uschar *expy_bundle = NULL;
+static uschar *expy_code_cache = NULL;
 static BOOL    expy_enabled = TRUE;
+static BOOL    expy_expand_cache = FALSE;
+static BOOL    expy_forkserver = FALSE;
+static BOOL    expy_log_timing = FALSE;
+static uschar *expy_path = NULL;
 static uschar *expy_path_add = NULL;
+static uschar *expy_program_name = US"/usr/local/bin/python";
+static int     expy_reload_interval = 0;
+static BOOL    expy_isolated = FALSE;
+static BOOL    expy_site = TRUE;
+static BOOL    expy_preload = FALSE;
 static uschar *expy_exim_module = US"exim";
+static BOOL    expy_memory_report = FALSE;
+static BOOL    expy_scan_context = FALSE;
 static uschar *expy_scan_module = US"exim_local_scan";
 static uschar *expy_scan_function = US"local_scan";
 static uschar *expy_scan_failure = US"defer";
+static uschar *expy_scan_socket = NULL;
+static int     expy_scan_timeout = 60;
 
 optionlist local_scan_options[] =
     {
+    { "expy_bundle",  opt_stringptr, &expy_bundle },
+    { "expy_code_cache",  opt_stringptr, &expy_code_cache },
     { "expy_enabled", opt_bool, &expy_enabled},
     { "expy_exim_module",  opt_stringptr, &expy_exim_module },
+    { "expy_expand_cache", opt_bool, &expy_expand_cache },
+    { "expy_forkserver", opt_bool, &expy_forkserver },
+    { "expy_isolated", opt_bool, &expy_isolated },
+    { "expy_log_timing", opt_bool, &expy_log_timing },
+    { "expy_memory_report", opt_bool, &expy_memory_report },
+    { "expy_path",  opt_stringptr, &expy_path },
     { "expy_path_add",  opt_stringptr, &expy_path_add },
+    { "expy_preload", opt_bool, &expy_preload },
+    { "expy_program_name",  opt_stringptr, &expy_program_name },
+    { "expy_reload_interval",  opt_time, &expy_reload_interval },
+    { "expy_scan_context", opt_bool, &expy_scan_context },
     { "expy_scan_failure",  opt_stringptr, &expy_scan_failure},
     { "expy_scan_function",  opt_stringptr, &expy_scan_function },
     { "expy_scan_module",  opt_stringptr, &expy_scan_module },
+    { "expy_scan_socket",  opt_stringptr, &expy_scan_socket },
+    { "expy_scan_timeout",  opt_time, &expy_scan_timeout },
+    { "expy_site", opt_bool, &expy_site },
     };
 
 int local_scan_options_count = sizeof(local_scan_options)/sizeof(optionlist);
@@ -65,6 +106,41 @@ int local_scan_options_count = sizeof(local_scan_options)/sizeof(optionlist);
 
 static PyObject *expy_exim_dict = NULL;
 static PyObject *expy_user_module = NULL;
+static PyObject *expy_user_func = NULL;     /* expy_scan_function in expy_user_module */
+static PyObject *expy_empty_tuple = NULL;   /* Arguments for calling expy_user_func */
+static PyObject *expy_var_cache = NULL;     /* exim.var() results for the current message */
+static PyObject *expy_expand_memo = NULL;   /* Expansion results for the current message */
+static PyObject *expy_expansion_error = NULL;  /* exim.ExpansionError exception class */
+static PyObject *expy_header_index = NULL;  /* Lowercased name -> list of header objects, built when needed */
+static long expy_expand_hits = 0;        /* Expansions found in expy_expand_memo, for exim.stats() */
+static long expy_expand_misses = 0;      /* and ones that weren't */
+static long expy_header_allocs = 0;      /* Header objects newly allocated, for exim.stats() */
+static long expy_header_reuses = 0;      /* and ones taken from the free list */
+
+#ifdef __GLIBC__
+static BOOL expy_is_daemon = FALSE;      /* Process was started with -bd */
+static BOOL expy_preload_tried = FALSE;  /* Only make one preload attempt */
+#endif
+static pid_t expy_memory_reported = 0;   /* pid that last logged its memory use */
+static long expy_init_usec = 0;          /* How long expy_init_python() took, for expy_log_timing */
+static time_t expy_module_mtime = 0;     /* Modification time of the scan module when imported */
+static time_t expy_reload_checked = 0;   /* When we last looked for a newer scan module */
+static time_t expy_reload_failed = 0;    /* Modification time of a version that wouldn't import */
+static int expy_recipients_live = -1;    /* Length of exim.recipients once it's been changed, or -1 */
+static BOOL expy_options_checked = FALSE; /* Settings that do nothing have been logged */
+
+
+/*
+ * Forget the expansion and variable results remembered so far,
+ * because the message has changed (or it's a new message)
+ */
+static void expy_expansions_changed(void)
+    {
+    if (expy_var_cache)
+        PyDict_Clear(expy_var_cache);
+    if (expy_expand_memo)
+        PyDict_Clear(expy_expand_memo);
+    }
 
 
 /* ------- Custom type for holding header lines ------
@@ -74,7 +150,15 @@ static PyObject *expy_user_module = NULL;
   values.  Usually it'd be '*' which Exim interprets as
   meaning the line should be deleted.
 
-  Also accessible for backwards compatibility as a sequence
+  .name (lowercased) and .value are the header line split at
+  the first colon, and .decoded is .value with any RFC 2047
+  encoded-words decoded.  Each of these is only made into a
+  Python string the first time it's asked for, and the same
+  string is handed out after that.
+
+  The object also supports the buffer interface, read-only, over
+  Exim's copy of the line, so buffer(), memoryview() and the re
+  module can get at the text without it being copied at all.
 
 */
 
@@ -82,563 +166,5096 @@ typedef struct
     {
     PyObject_HEAD
     header_line *hline;
+    PyObject *text;    /* Cached attribute values, NULL until asked for */
+    PyObject *name;
+    PyObject *value;
+    PyObject *decoded;
     } expy_header_line_t;
 
 
-static void expy_header_line_dealloc(PyObject *self)
+static void expy_header_line_clear(expy_header_line_t *self)
     {
-    PyObject_Del(self);
+    Py_CLEAR(self->text);
+    Py_CLEAR(self->name);
+    Py_CLEAR(self->value);
+    Py_CLEAR(self->decoded);
     }
 
 
-static PyObject * expy_header_line_getattr(expy_header_line_t *self, char *name)
+/*
+ * Header objects that have been freed are kept for re-use, up to
+ * a point, linked together through their hline fields, so a process
+ * handling one message after another doesn't keep going back to
+ * the allocator for them.
+ */
+#define EXPY_HEADER_FREE_MAX 512
+
+static expy_header_line_t *expy_header_free = NULL;
+static int expy_header_free_count = 0;
+
+
+static void expy_header_line_dealloc(PyObject *self)
     {
-    if (self->hline == NULL)
-        {
-        PyErr_Format(PyExc_AttributeError, "Header object no longer valid, held over from previously processed message?");
-        return NULL;
-        }
+    expy_header_line_t *h = (expy_header_line_t *)self;
 
-    if (!strcmp(name, "text"))
-        return PyString_FromString((const char *)self->hline->text);
+    expy_header_line_clear(h);
 
-    if (!strcmp(name, "type"))
+    if (expy_header_free_count < EXPY_HEADER_FREE_MAX)
         {
-        char ch = (char)(self->hline->type);
-        return PyString_FromStringAndSize(&ch, 1);
+        h->hline = (header_line *)expy_header_free;
+        expy_header_free = h;
+        expy_header_free_count++;
+        return;
         }
 
-    PyErr_Format(PyExc_AttributeError, "Unknown attribute: %s", name);
-    return NULL;
+    PyObject_Del(self);
     }
 
 
-static int expy_header_line_setattr(expy_header_line_t *self, char *name, PyObject *value)
+static BOOL expy_header_line_valid(expy_header_line_t *self)
     {
     if (self->hline == NULL)
         {
         PyErr_Format(PyExc_AttributeError, "Header object no longer valid, held over from previously processed message?");
-        return -1;
+        return FALSE;
         }
 
-    if (!strcmp(name, "type"))
-        {
-        char *p;
-#if PY_MINOR_VERSION < 5
-        int len;
-#else
-        Py_ssize_t len;
-#endif
+    return TRUE;
+    }
 
-        if (PyString_AsStringAndSize(value, &p, &len) == -1)
-            return -1;
 
-        if (len != 1)
-            {
-            PyErr_SetString(PyExc_TypeError, "header.type can only be set to a single-character value");
-            return -1;
-            }
+/*
+ * Decode RFC 2047 encoded-words in a string, into headers_charset,
+ * with Exim doing the work, optionally dropping trailing whitespace.
+ * Returns New reference, or NULL with ValueError set if it can't be
+ * decoded.
+ */
+static PyObject *expy_rfc2047_decode(uschar *str, BOOL strip)
+    {
+    uschar *result;
+    uschar *error = NULL;
+    int len;
 
-        self->hline->type = (int)(p[0]);
-        return 0;
+    result = rfc2047_decode(str, FALSE, headers_charset, '?', &len, &error);
+    if (!result)
+        {
+        PyErr_Format(PyExc_ValueError, "decoding [%s] failed: %s", str, error ? (char *)error : "unknown error");
+        return NULL;
         }
 
-    PyErr_Format(PyExc_AttributeError, "Attribute: %s is not settable", name);
-    return -1;
-    }
-
+    while (strip && (len > 0) && isspace(result[len - 1]))
+        len--;
 
-static PyTypeObject ExPy_Header_Line  =
-    {
-    PyObject_HEAD_INIT(NULL)    /* Workaround problem with Cygwin/GCC, by setting to &PyType_Type at runtime */
-    0,                          /*ob_size*/
-    "ExPy Header Line",         /*tp_name*/
-    sizeof(expy_header_line_t), /*tp_size*/
-    0,                          /*tp_itemsize*/
-    expy_header_line_dealloc,   /*tp_dealloc*/
-    0,                          /*tp_print*/
-    (getattrfunc) expy_header_line_getattr,  /*tp_getattr*/
-    (setattrfunc) expy_header_line_setattr,  /*tp_setattr*/
-    };
+    return PyString_FromStringAndSize((const char *)result, len);
+    }
 
 
-PyObject * expy_create_header_line(header_line *p)
+/*
+ * Where the value of a header line starts, after the first colon
+ * and any whitespace, and where the colon is (the start of the line
+ * if there isn't one)
+ */
+static const char *expy_header_line_value_start(header_line *hline, const char **colon)
     {
-    expy_header_line_t * result;
+    const char *text = (const char *)hline->text;
+    const char *end = text + hline->slen;
+    const char *p;
 
-    result = PyObject_NEW(expy_header_line_t, &ExPy_Header_Line);  /* New Reference */
-    if (!result)
-        return NULL;
+    *colon = memchr(text, ':', hline->slen);
+    if (!*colon)
+        *colon = p = text;
+    else
+        p = *colon + 1;
 
-    result->hline = p;
+    while ((p < end) && isspace((unsigned char)*p))
+        p++;
 
-    return (PyObject *) result;
+    return p;
     }
 
 
-/* ------- Helper functions for Module methods ------- */
-
 /*
- * Given a C string, make sure it's safe to pass to a
- * printf-style function ('%' chars are escaped by doubling
- * them up.  Optionally, also make sure the string ends with a '\n'
+ * Split the header line into .name and .value - the name is
+ * lowercased and the value has surrounding whitespace (including
+ * the final newline) removed.  A line with no colon is all value.
  */
-static char *get_format_string(char *str, int need_newline)
+static BOOL expy_header_line_split(expy_header_line_t *self)
     {
-    char *p;
+    const char *text = (const char *)self->hline->text;
+    const char *end = text + self->hline->slen;
+    const char *colon;
+    const char *p;
     char *q;
-    char *newstr;
-    /*
-     * If there are more percentage signs, or if the string is longer,
-     * than the maximum number that will fit in an unsigned int on this
-     * platform, then this will overflow.  That seems extremely
-     * unlikely.
-     */
-    unsigned int percent_count;
-    unsigned int len;
-    /* Count number of '%' characters in string, and get the total length while at it */
-    for (p = str, percent_count = 0; *p; p++)
-        if (*p == '%')
-            percent_count++;
-    len = p - str;
-
-    /* Decide if we need a newline added */
-    if (need_newline)
-        {
-        if (len && (*(p-1) == '\n'))
-            need_newline = 0;
-        else
-            need_newline = 1; /* paranoia - just in case something other than 1 was used to indicate truth */
-        }
 
-    /* If it's all good, just return the string we were passed */
-    if ((!percent_count) && (!need_newline))
-        return str;
+    p = expy_header_line_value_start(self->hline, &colon);
+    while ((end > p) && isspace((unsigned char)end[-1]))
+        end--;
 
-    /* Gotta make a new string, with '%'s and/or '\n' added */
-    newstr = store_get(len + percent_count + need_newline + 1, 0);
+    self->value = PyString_FromStringAndSize(p, end - p);   /* New reference */
+    if (!self->value)
+        return FALSE;
 
-    for (p = str, q = newstr; *p; p++, q++)
-        {
-        *q = *p;
-        if (*q == '%')
-            {
-            q++;
-            *q = '%';
-            }
-        }
+    for (end = colon; (end > text) && isspace((unsigned char)end[-1]); end--)
+        ;
 
-    if (need_newline)
+    self->name = PyString_FromStringAndSize(NULL, end - text);  /* New reference */
+    if (!self->name)
         {
-        *q = '\n';
-        q++;
+        Py_CLEAR(self->value);
+        return FALSE;
         }
 
-    *q = 0;
+    for (p = text, q = PyString_AS_STRING(self->name); p < end; p++, q++)
+        *q = tolower((unsigned char)*p);
 
-    return newstr;
+    return TRUE;
     }
 
-/* -------- Module Methods ------------ */
 
-/*
- * Have Exim do a string expansion, will raise
- * a Python ValueError exception if the expansion fails
- */
-static PyObject *expy_expand_string(PyObject *self, PyObject *args)
+static PyObject *expy_header_line_get_text(expy_header_line_t *self, void *closure)
     {
-    char *str;
-    uschar *result;
-
-    if (!PyArg_ParseTuple(args, "s", &str))
+    if (!expy_header_line_valid(self))
         return NULL;
 
-    result = expand_string((uschar *)str);
-
-    if (!result)
+    if (!self->text)
         {
-        PyErr_Format(PyExc_ValueError, "expansion [%s] failed: %s", str, expand_string_message);
-        return NULL;
+        self->text = PyString_FromStringAndSize((const char *)self->hline->text, self->hline->slen);
+        if (!self->text)
+            return NULL;
         }
 
-    return PyString_FromString((const char *)result);
+    Py_INCREF(self->text);
+    return self->text;
     }
 
 
-/*
- * Add a header line, will automatically tack on a '\n' if necessary
- */
-static PyObject *expy_header_add(PyObject *self, PyObject *args)
+static PyObject *expy_header_line_get_name(expy_header_line_t *self, void *closure)
     {
-    char *str;
-
-    if (!PyArg_ParseTuple(args, "s", &str))
+    if (!expy_header_line_valid(self))
         return NULL;
 
-    header_add(' ', get_format_string(str, 1));
-    PyList_Append(PyDict_GetItemString(expy_exim_dict, "headers"),
-                  expy_create_header_line(header_last));
+    if (!self->name && !expy_header_line_split(self))
+        return NULL;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_INCREF(self->name);
+    return self->name;
     }
 
 
-/*
- * Write to exim log, uses LOG_MAIN by default
- */
-static PyObject *expy_log_write(PyObject *self, PyObject *args)
+static PyObject *expy_header_line_get_value(expy_header_line_t *self, void *closure)
     {
-    char *str;
-    int which = LOG_MAIN;
-
-    if (!PyArg_ParseTuple(args, "s|i", &str, &which))
+    if (!expy_header_line_valid(self))
         return NULL;
 
-    log_write(0, which, "%s", get_format_string(str, 0));
+    if (!self->value && !expy_header_line_split(self))
+        return NULL;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_INCREF(self->value);
+    return self->value;
     }
 
+
 /*
- * Print through Exim's debug_print() function, which does nothing if
- * Exim isn't in debugging mode.
+ * The value decoded straight from the line's text.  If Exim can't
+ * decode it, it's left as it is.
  */
-static PyObject *expy_debug_print(PyObject *self, PyObject *args)
+static PyObject *expy_header_line_get_decoded(expy_header_line_t *self, void *closure)
     {
-    char *str;
-
-    if (!PyArg_ParseTuple(args, "s", &str))
+    if (!expy_header_line_valid(self))
         return NULL;
 
-    debug_printf("%s", get_format_string(str, 0));
+    if (!self->decoded)
+        {
+        const char *colon;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+        self->decoded = expy_rfc2047_decode((uschar *)expy_header_line_value_start(self->hline, &colon), TRUE);
+        if (!self->decoded)
+            {
+            if (!PyErr_ExceptionMatches(PyExc_ValueError))
+                return NULL;
+
+            PyErr_Clear();
+            if (!self->value && !expy_header_line_split(self))
+                return NULL;
+
+            self->decoded = self->value;
+            Py_INCREF(self->decoded);
+            }
+        }
+
+    Py_INCREF(self->decoded);
+    return self->decoded;
     }
 
-/*
- * Create a child process that runs the command specified.
- * The return value is (stdout, stdin, pid), where stdout and stdin are file
- * descriptors to the appropriate pipes (stderr is joined with stdout).
- * The environment may be specified, and a new umask supplied.
- */
-static PyObject *expy_child_open(PyObject *self, PyObject *args)
+
+static PyObject *expy_header_line_get_type(expy_header_line_t *self, void *closure)
     {
-    pid_t pid;
-    int infdptr;
-    int outfdptr;
-    PyObject * py_argv;
-    PyObject * py_envp;
-    int umask;
-    unsigned char make_leader = 0;
-    Py_ssize_t i;
-    Py_ssize_t argc;
-    uschar ** argv;
-    uschar ** envp;
-    Py_ssize_t envp_len;
+    char ch;
 
-    /*
-     * The first two arguments are tuples of strings (argv, envp).
-     */
-    if (!PyArg_ParseTuple(args, "OOi|b", &py_argv, &py_envp, &umask, &make_leader))
+    if (!expy_header_line_valid(self))
         return NULL;
 
-    argc = PySequence_Size(py_argv);
-    argv = PyMem_New(uschar *, argc + 1);
-    for (i=0; i<argc; ++i)
+    ch = (char)(self->hline->type);
+    return PyString_FromStringAndSize(&ch, 1);
+    }
+
+
+static int expy_header_line_set_type(expy_header_line_t *self, PyObject *value, void *closure)
+    {
+    char *p;
+#if PY_MINOR_VERSION < 5
+    int len;
+#else
+    Py_ssize_t len;
+#endif
+
+    if (!expy_header_line_valid(self))
+        return -1;
+
+    if (!value)
         {
-        argv[i] = (uschar *)PyString_AsString(PyTuple_GET_ITEM(py_argv, i)); /* borrowed ref */
+        PyErr_SetString(PyExc_TypeError, "header.type can't be deleted");
+        return -1;
         }
-    argv[argc] = NULL;
-    envp_len = PySequence_Size(py_envp);
-    envp = PyMem_New(uschar *, envp_len + 1);
-    for (i=0; i<envp_len; ++i)
+
+    if (PyString_AsStringAndSize(value, &p, &len) == -1)
+        return -1;
+
+    if (len != 1)
         {
-        envp[i] = (uschar *)PyString_AsString(PyTuple_GET_ITEM(py_envp, i)); /* borrowed ref */
+        PyErr_SetString(PyExc_TypeError, "header.type can only be set to a single-character value");
+        return -1;
         }
-    envp[envp_len] = NULL;
-    pid = child_open(argv, envp, umask, &infdptr, &outfdptr, (BOOL) make_leader);
-    PyMem_Del(argv);
-    PyMem_Del(envp);
-    if (pid == -1)
-    {
-        /*
-         * An error occurred.
-         */
-        PyErr_Format(PyExc_OSError, "error %d", errno);
-        return NULL;
-    }
 
-    return Py_BuildValue("(iii)", infdptr, outfdptr, pid);
+    if (self->hline->type != (int)(p[0]))
+        expy_expansions_changed();   /* $h_ variables skip deleted headers */
+
+    self->hline->type = (int)(p[0]);
+    return 0;
     }
 
+
+static PyGetSetDef expy_header_line_getset[] =
+    {
+    {"text", (getter) expy_header_line_get_text, NULL, "The whole header line.", NULL},
+    {"type", (getter) expy_header_line_get_type, (setter) expy_header_line_set_type, "Exim's type character for the line.", NULL},
+    {"name", (getter) expy_header_line_get_name, NULL, "Header name, lowercased.", NULL},
+    {"value", (getter) expy_header_line_get_value, NULL, "Text after the colon, stripped.", NULL},
+    {"decoded", (getter) expy_header_line_get_decoded, NULL, "Value with RFC 2047 encoded-words decoded.", NULL},
+    {NULL}
+    };
+
+
 /*
- * Wait for a child process to terminate, or for a timeout (in seconds) to
- * expire.  A timeout of zero (the default) means wait as long as it takes.
- * The return value is the process ending status.
+ * Buffer interface, straight onto the header_line text
  */
-static PyObject *expy_child_close(PyObject *self, PyObject *args)
+static Py_ssize_t expy_header_line_getreadbuffer(expy_header_line_t *self, Py_ssize_t segment, void **ptr)
     {
-    int pid;
-    int timeout = 0;
-    int result;
+    if (!expy_header_line_valid(self))
+        return -1;
 
-    if (!PyArg_ParseTuple(args, "i|i", &pid, &timeout))
-        return NULL;
+    if (segment != 0)
+        {
+        PyErr_SetString(PyExc_SystemError, "accessing non-existent header segment");
+        return -1;
+        }
 
-    result = child_close((pid_t) pid, timeout);
+    *ptr = self->hline->text;
+    return self->hline->slen;
+    }
 
-    if (result < 0 && result > -256)
+
+static Py_ssize_t expy_header_line_getsegcount(expy_header_line_t *self, Py_ssize_t *lenp)
     {
-        /*
-         * The process was ended by a signal.  The result is the negation
-         * of the signal number.
-         */
-        PyErr_Format(PyExc_OSError, "ended by signal %d", result * -1);
+    if (lenp)
+        *lenp = self->hline ? self->hline->slen : 0;
+
+    return 1;
+    }
+
+
+#if PY_VERSION_HEX >= 0x02060000
+static int expy_header_line_getbuffer(expy_header_line_t *self, Py_buffer *view, int flags)
+    {
+    if (!expy_header_line_valid(self))
+        return -1;
+
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->hline->text, self->hline->slen, 1, flags);
+    }
+#endif
+
+
+/*
+ * len() and slicing work on the text, which the re module needs
+ * to go with the buffer (a slice is copied out as a string)
+ */
+static Py_ssize_t expy_header_line_length(expy_header_line_t *self)
+    {
+    if (!expy_header_line_valid(self))
+        return -1;
+
+    return self->hline->slen;
+    }
+
+
+static PyObject *expy_header_line_slice(expy_header_line_t *self, Py_ssize_t low, Py_ssize_t high)
+    {
+    if (!expy_header_line_valid(self))
         return NULL;
+
+    if (low < 0)
+        low = 0;
+    if (high > self->hline->slen)
+        high = self->hline->slen;
+    if (high < low)
+        high = low;
+
+    return PyString_FromStringAndSize((const char *)self->hline->text + low, high - low);
     }
-    else if (result == -256)
+
+
+static PySequenceMethods expy_header_line_as_sequence =
     {
-        /*
-         * The process timed out.
-         */
-        PyErr_Format(PyExc_OSError, "timed out");
+    (lenfunc) expy_header_line_length,          /*sq_length*/
+    0,                                          /*sq_concat*/
+    0,                                          /*sq_repeat*/
+    0,                                          /*sq_item*/
+    (ssizessizeargfunc) expy_header_line_slice, /*sq_slice*/
+    };
+
+
+static PyBufferProcs expy_header_line_as_buffer =
+    {
+    (readbufferproc) expy_header_line_getreadbuffer,   /*bf_getreadbuffer*/
+    0,                                                  /*bf_getwritebuffer*/
+    (segcountproc) expy_header_line_getsegcount,       /*bf_getsegcount*/
+    (charbufferproc) expy_header_line_getreadbuffer,   /*bf_getcharbuffer*/
+#if PY_VERSION_HEX >= 0x02060000
+    (getbufferproc) expy_header_line_getbuffer,        /*bf_getbuffer*/
+    0,                                                  /*bf_releasebuffer*/
+#endif
+    };
+
+
+static PyTypeObject ExPy_Header_Line  =
+    {
+    PyObject_HEAD_INIT(NULL)    /* Workaround problem with Cygwin/GCC, by setting to &PyType_Type at runtime */
+    0,                          /*ob_size*/
+    "ExPy Header Line",         /*tp_name*/
+    sizeof(expy_header_line_t), /*tp_size*/
+    0,                          /*tp_itemsize*/
+    expy_header_line_dealloc,   /*tp_dealloc*/
+    };
+
+
+/*
+ * Set up the header type, returns FALSE on failure
+ */
+static BOOL expy_header_line_type_init(void)
+    {
+    ExPy_Header_Line.tp_flags = Py_TPFLAGS_DEFAULT;
+#if PY_VERSION_HEX >= 0x02060000
+    ExPy_Header_Line.tp_flags |= Py_TPFLAGS_HAVE_NEWBUFFER;
+#endif
+    ExPy_Header_Line.tp_getset = expy_header_line_getset;
+    ExPy_Header_Line.tp_as_buffer = &expy_header_line_as_buffer;
+    ExPy_Header_Line.tp_as_sequence = &expy_header_line_as_sequence;
+    return PyType_Ready(&ExPy_Header_Line) == 0;
+    }
+
+
+PyObject * expy_create_header_line(header_line *p)
+    {
+    expy_header_line_t * result;
+
+    if (expy_header_free)
+        {
+        result = expy_header_free;
+        expy_header_free = (expy_header_line_t *)result->hline;
+        expy_header_free_count--;
+        result = (expy_header_line_t *) PyObject_INIT(result, &ExPy_Header_Line);   /* New Reference */
+        expy_header_reuses++;
+        }
+    else
+        {
+        result = PyObject_NEW(expy_header_line_t, &ExPy_Header_Line);  /* New Reference */
+        if (!result)
+            return NULL;
+        expy_header_allocs++;
+        }
+
+    result->hline = p;
+    result->text = NULL;
+    result->name = NULL;
+    result->value = NULL;
+    result->decoded = NULL;
+
+    return (PyObject *) result;
+    }
+
+
+/* ------- Custom type for the list of header lines ------
+
+  exim.headers is one of these rather than a Python list, so nothing
+  is done about the headers of a message unless the Python code looks
+  at them.  The first time it does, Exim's header_list is copied into
+  an array so it can be indexed, and each header object is only made
+  when its item is asked for.  Lines added with exim.add_header()
+  show up at the end.
+
+  As with the message object, the same one is used again for the
+  next message, unless the Python code has held on to it, and its
+  arrays are kept too, so a message whose headers aren't looked at
+  doesn't allocate anything.
+
+*/
+
+typedef struct
+    {
+    PyObject_HEAD
+    BOOL valid;
+    BOOL filled;               /* lines[] has been copied from header_list */
+    Py_ssize_t count;          /* Number of lines in lines[] */
+    Py_ssize_t size;           /* Room in lines[] and objects[] */
+    header_line **lines;
+    PyObject **objects;        /* Header object for each line, NULL until asked for */
+    } expy_headers_t;
+
+static expy_headers_t *expy_headers = NULL;   /* exim.headers for the current or last message */
+
+
+static BOOL expy_headers_valid(expy_headers_t *self)
+    {
+    if (!self->valid)
+        {
+        PyErr_Format(PyExc_ValueError, "Headers object no longer valid, held over from previously processed message?");
+        return FALSE;
+        }
+
+    return TRUE;
+    }
+
+
+/*
+ * Make room for at least n lines
+ */
+static BOOL expy_headers_grow(expy_headers_t *self, Py_ssize_t n)
+    {
+    header_line **lines;
+    PyObject **objects;
+    Py_ssize_t size;
+
+    if (n <= self->size)
+        return TRUE;
+
+    for (size = self->size ? self->size : 32; size < n; size *= 2)
+        ;
+
+    lines = PyMem_Realloc(self->lines, size * sizeof(header_line *));
+    if (!lines)
+        {
+        PyErr_NoMemory();
+        return FALSE;
+        }
+    self->lines = lines;
+
+    objects = PyMem_Realloc(self->objects, size * sizeof(PyObject *));
+    if (!objects)
+        {
+        PyErr_NoMemory();
+        return FALSE;
+        }
+    self->objects = objects;
+
+    self->size = size;
+    return TRUE;
+    }
+
+
+/*
+ * Copy Exim's linked list of header lines into our array,
+ * if that hasn't been done yet for this message
+ */
+static BOOL expy_headers_fill(expy_headers_t *self)
+    {
+    header_line *p;
+    Py_ssize_t n;
+
+    if (self->filled)
+        return TRUE;
+
+    for (n = 0, p = header_list; p; p = p->next)
+        n++;
+
+    if (!expy_headers_grow(self, n))
+        return FALSE;
+
+    for (n = 0, p = header_list; p; p = p->next, n++)
+        {
+        self->lines[n] = p;
+        self->objects[n] = NULL;
+        }
+
+    self->count = n;
+    self->filled = TRUE;
+    return TRUE;
+    }
+
+
+/*
+ * Header object for line i, which must be in range.
+ * Returns Borrowed reference
+ */
+static PyObject *expy_headers_get(expy_headers_t *self, Py_ssize_t i)
+    {
+    if (!self->objects[i])
+        self->objects[i] = expy_create_header_line(self->lines[i]);   /* New reference */
+
+    return self->objects[i];
+    }
+
+
+static Py_ssize_t expy_headers_length(expy_headers_t *self)
+    {
+    if (!expy_headers_valid(self) || !expy_headers_fill(self))
+        return -1;
+
+    return self->count;
+    }
+
+
+static PyObject *expy_headers_item(expy_headers_t *self, Py_ssize_t i)
+    {
+    PyObject *result;
+
+    if (!expy_headers_valid(self) || !expy_headers_fill(self))
+        return NULL;
+
+    if ((i < 0) || (i >= self->count))
+        {
+        PyErr_SetString(PyExc_IndexError, "header index out of range");
         return NULL;
+        }
+
+    result = expy_headers_get(self, i);
+    Py_XINCREF(result);
+    return result;
     }
-    else if (result < -256)
+
+
+static PyObject *expy_headers_slice(expy_headers_t *self, Py_ssize_t low, Py_ssize_t high)
     {
-        /*
-         * An error occurred.
-         */
-        PyErr_Format(PyExc_OSError, "error %d", errno);
+    PyObject *result;
+    Py_ssize_t i;
+
+    if (!expy_headers_valid(self) || !expy_headers_fill(self))
         return NULL;
+
+    if (low < 0)
+        low = 0;
+    if (high > self->count)
+        high = self->count;
+    if (high < low)
+        high = low;
+
+    result = PyList_New(high - low);    /* New reference */
+    for (i = low; result && (i < high); i++)
+        {
+        PyObject *h = expy_headers_get(self, i);   /* Borrowed reference */
+        if (!h)
+            {
+            Py_CLEAR(result);
+            break;
+            }
+
+        Py_INCREF(h);
+        PyList_SET_ITEM(result, i - low, h);
+        }
+
+    return result;
     }
 
-    return PyInt_FromLong(result);
+
+/*
+ * Invalidate the header objects made for the message and forget them
+ */
+static void expy_headers_clear(expy_headers_t *self)
+    {
+    Py_ssize_t i;
+
+    for (i = 0; self->filled && (i < self->count); i++)
+        {
+        expy_header_line_t *h = (expy_header_line_t *) self->objects[i];
+
+        if (h)
+            {
+            h->hline = NULL;
+            expy_header_line_clear(h);
+            Py_DECREF(h);
+            }
+        }
+
+    self->valid = FALSE;
+    self->filled = FALSE;
+    self->count = 0;
+    }
+
+
+static void expy_headers_dealloc(PyObject *self)
+    {
+    expy_headers_t *headers = (expy_headers_t *)self;
+
+    expy_headers_clear(headers);
+    PyMem_Free(headers->lines);
+    PyMem_Free(headers->objects);
+    PyObject_Del(self);
+    }
+
+
+static PySequenceMethods expy_headers_as_sequence =
+    {
+    (lenfunc) expy_headers_length,          /*sq_length*/
+    0,                                      /*sq_concat*/
+    0,                                      /*sq_repeat*/
+    (ssizeargfunc) expy_headers_item,       /*sq_item*/
+    (ssizessizeargfunc) expy_headers_slice, /*sq_slice*/
+    };
+
+
+static PyTypeObject ExPy_Headers  =
+    {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /*ob_size*/
+    "ExPy Headers",             /*tp_name*/
+    sizeof(expy_headers_t),     /*tp_size*/
+    0,                          /*tp_itemsize*/
+    expy_headers_dealloc,       /*tp_dealloc*/
+    };
+
+
+static BOOL expy_headers_type_init(void)
+    {
+    ExPy_Headers.tp_flags = Py_TPFLAGS_DEFAULT;
+    ExPy_Headers.tp_as_sequence = &expy_headers_as_sequence;
+    return PyType_Ready(&ExPy_Headers) == 0;
     }
 
+
 /*
- * Note that this is the child_open_exim2 method from the Exim local_scan
- * API - any child_open_exim call can be done through this method as well.
- * Also, rather than returning a file descriptor, we take the message
- * content as an argument, and write it out to the subprocess.  We still
- * return the PID, so that execution can continue while Exim is processing
- * the message if the caller so desires.
- * Submit a new message to Exim, returning the PID of the subprocess.
- * Essentially, this is running 'exim -t -oem -oi -f sender -oMas auth'
- * (-oMas is omitted if no authentication is provided).
+ * Get the headers object for a new message, re-using the last one
+ * if nothing else is holding on to it.  Returns Borrowed reference,
+ * or NULL on failure.
  */
-static PyObject *expy_child_open_exim(PyObject *self, PyObject *args)
+static PyObject *expy_headers_begin(void)
     {
-    char *message;
-    int message_length;
-    char *sender = "";
-    char *sender_authentication = NULL;
-    pid_t exim_pid;
-    int fd;
+    if (expy_headers)
+        {
+        Py_ssize_t refs = 1;
+
+        if (PyDict_GetItemString(expy_exim_dict, "headers") == (PyObject *)expy_headers)
+            refs++;
+
+        if (Py_REFCNT(expy_headers) != refs)
+            Py_CLEAR(expy_headers);   /* Held over, so it stays invalid */
+        }
+
+    if (!expy_headers)
+        {
+        expy_headers = PyObject_NEW(expy_headers_t, &ExPy_Headers);  /* New Reference */
+        if (!expy_headers)
+            return NULL;
+
+        expy_headers->filled = FALSE;
+        expy_headers->count = 0;
+        expy_headers->size = 0;
+        expy_headers->lines = NULL;
+        expy_headers->objects = NULL;
+        }
+
+    expy_headers->valid = TRUE;
+    return (PyObject *)expy_headers;
+    }
+
+
+/*
+ * A line has been added to the end of Exim's header_list, add it to
+ * ours too if we've already copied it.  Returns the header object
+ * for it if one's wanted, as a Borrowed reference.
+ */
+static PyObject *expy_headers_added(header_line *p, BOOL want_object)
+    {
+    if (!expy_headers || !expy_headers->valid || !expy_headers->filled)
+        return NULL;
+
+    if (!expy_headers_grow(expy_headers, expy_headers->count + 1))
+        {
+        expy_headers->filled = FALSE;     /* Start again from header_list next time */
+        return NULL;
+        }
+
+    expy_headers->lines[expy_headers->count] = p;
+    expy_headers->objects[expy_headers->count] = NULL;
+    expy_headers->count++;
+
+    return want_object ? expy_headers_get(expy_headers, expy_headers->count - 1) : NULL;
+    }
+
+
+/*
+ * Done with the message
+ */
+static void expy_headers_end(void)
+    {
+    Py_CLEAR(expy_header_index);
+
+    if (expy_headers)
+        expy_headers_clear(expy_headers);
+    }
+
+
+/*
+ * Add a header object to expy_header_index, under its name
+ */
+static BOOL expy_header_index_add(expy_header_line_t *h)
+    {
+    PyObject *list;
+
+    if (!h->name && !expy_header_line_split(h))
+        return FALSE;
+
+    list = PyDict_GetItem(expy_header_index, h->name);  /* Borrowed reference */
+    if (!list)
+        {
+        int rc;
+
+        list = PyList_New(0);                               /* New reference */
+        if (!list)
+            return FALSE;
+        rc = PyDict_SetItem(expy_header_index, h->name, list);
+        Py_DECREF(list);                                    /* dict holds it now */
+        if (rc < 0)
+            return FALSE;
+        }
+
+    return PyList_Append(list, (PyObject *)h) == 0;
+    }
+
+
+/*
+ * Find the header objects with a given name, building the index of
+ * them all if this is the first lookup for the message.  Returns
+ * Borrowed reference to a list, or None if there aren't any.
+ */
+static PyObject *expy_header_index_lookup(const char *name)
+    {
+    PyObject *key;
+    PyObject *list;
+    char *p;
+
+    if (!expy_header_index)
+        {
+        Py_ssize_t i;
+
+        expy_header_index = PyDict_New();   /* New reference */
+        if (!expy_header_index)
+            return NULL;
+
+        if (expy_headers && expy_headers->valid && !expy_headers_fill(expy_headers))
+            {
+            Py_CLEAR(expy_header_index);
+            return NULL;
+            }
+
+        for (i = 0; expy_headers && expy_headers->valid && (i < expy_headers->count); i++)
+            {
+            expy_header_line_t *h = (expy_header_line_t *) expy_headers_get(expy_headers, i); /* Borrowed reference */
+
+            if (!h || !expy_header_index_add(h))
+                {
+                Py_CLEAR(expy_header_index);
+                return NULL;
+                }
+            }
+        }
+
+    key = PyString_FromString(name);    /* New reference */
+    if (!key)
+        return NULL;
+
+    for (p = PyString_AS_STRING(key); *p; p++)
+        *p = tolower((unsigned char)*p);
+
+    list = PyDict_GetItem(expy_header_index, key);  /* Borrowed reference */
+    Py_DECREF(key);
+
+    return list ? list : Py_None;
+    }
+
+
+/* ------- Parts of addresses ------
+
+  Addresses are split at the last '@', which is what Exim does too,
+  into the local part and the domain.  An address without an '@' is
+  all local part, with an empty domain.  Recipient objects and the
+  message object (for the sender) make each part only the first time
+  it's asked for, and keep it.
+
+*/
+
+#define EXPY_LOCAL_PART      0
+#define EXPY_DOMAIN          1
+#define EXPY_DOMAIN_LOWER    2
+#define EXPY_ADDRESS_PARTS   3
+
+static const char *expy_address_part_names[EXPY_ADDRESS_PARTS] = {"local_part", "domain", "domain_lower"};
+static const char *expy_sender_part_names[EXPY_ADDRESS_PARTS] = {"sender_local_part", "sender_domain", "sender_domain_lower"};
+
+
+/*
+ * Domain part of an address (after the last '@'), or NULL if there isn't one
+ */
+static const char *expy_address_domain(const char *address)
+    {
+    const char *at = strrchr(address, '@');
+
+    return at ? at + 1 : NULL;
+    }
+
+
+/*
+ * Get one part of an address into parts[which], along with any others
+ * that come for free (the domain serves as its own lowercased version
+ * if it's in lower case already).  Returns New reference to it.
+ */
+static PyObject *expy_address_part(const char *address, PyObject **parts, int which)
+    {
+    const char *domain;
+    const char *p;
+    char *q;
+
+    if (parts[which])
+        {
+        Py_INCREF(parts[which]);
+        return parts[which];
+        }
+
+    domain = expy_address_domain(address);
+
+    switch (which)
+        {
+        case EXPY_LOCAL_PART:
+            parts[which] = PyString_FromStringAndSize(address, domain ? domain - 1 - address : (Py_ssize_t)strlen(address));
+            break;
+
+        case EXPY_DOMAIN:
+            parts[which] = PyString_FromString(domain ? domain : "");
+            break;
+
+        case EXPY_DOMAIN_LOWER:
+            if (!domain)
+                domain = "";
+
+            for (p = domain; *p && !isupper((unsigned char)*p); p++)
+                ;
+
+            if (!*p)
+                {
+                /* Nothing to lowercase */
+                parts[which] = expy_address_part(address, parts, EXPY_DOMAIN);
+                break;
+                }
+
+            parts[which] = PyString_FromString(domain);
+            if (parts[which])
+                for (q = PyString_AS_STRING(parts[which]); *q; q++)
+                    *q = tolower((unsigned char)*q);
+            break;
+        }
+
+    Py_XINCREF(parts[which]);
+    return parts[which];
+    }
+
+
+static void expy_address_parts_clear(PyObject **parts)
+    {
+    int i;
+
+    for (i = 0; i < EXPY_ADDRESS_PARTS; i++)
+        Py_CLEAR(parts[i]);
+    }
+
+
+/* ------- Helper functions for Module methods ------- */
+
+/*
+ * Given a C string, make sure it's safe to pass to a
+ * printf-style function ('%' chars are escaped by doubling
+ * them up.  Optionally, also make sure the string ends with a '\n'
+ */
+static char *get_format_string(char *str, int need_newline)
+    {
+    char *p;
+    char *q;
+    char *newstr;
+    /*
+     * If there are more percentage signs, or if the string is longer,
+     * than the maximum number that will fit in an unsigned int on this
+     * platform, then this will overflow.  That seems extremely
+     * unlikely.
+     */
+    unsigned int percent_count;
+    unsigned int len;
+    /* Count number of '%' characters in string, and get the total length while at it */
+    for (p = str, percent_count = 0; *p; p++)
+        if (*p == '%')
+            percent_count++;
+    len = p - str;
+
+    /* Decide if we need a newline added */
+    if (need_newline)
+        {
+        if (len && (*(p-1) == '\n'))
+            need_newline = 0;
+        else
+            need_newline = 1; /* paranoia - just in case something other than 1 was used to indicate truth */
+        }
+
+    /* If it's all good, just return the string we were passed */
+    if ((!percent_count) && (!need_newline))
+        return str;
+
+    /* Gotta make a new string, with '%'s and/or '\n' added */
+    newstr = store_get(len + percent_count + need_newline + 1, 0);
+
+    for (p = str, q = newstr; *p; p++, q++)
+        {
+        *q = *p;
+        if (*q == '%')
+            {
+            q++;
+            *q = '%';
+            }
+        }
+
+    if (need_newline)
+        {
+        *q = '\n';
+        q++;
+        }
+
+    *q = 0;
+
+    return newstr;
+    }
+
+/* -------- Module Methods ------------ */
+
+/*
+ * Expand one string, or with expy_expand_cache set, find it already
+ * done for this message.  A failed expansion gives an ExpansionError
+ * object rather than raising it.  Returns New reference.
+ */
+static PyObject *expy_expand_memoized(PyObject *str)
+    {
+    PyObject *result;
+    uschar *expanded;
+    char *s;
+
+    if (expy_expand_cache)
+        {
+        result = PyDict_GetItem(expy_expand_memo, str);  /* Borrowed reference */
+        if (result)
+            {
+            expy_expand_hits++;
+            Py_INCREF(result);
+            return result;
+            }
+        }
+
+    s = PyString_AsString(str);
+    if (!s)
+        return NULL;
+
+    if (expy_expand_cache)
+        expy_expand_misses++;
+
+    expanded = expand_string((uschar *)s);
+    if (expanded)
+        result = PyString_FromString((const char *)expanded);
+    else
+        {
+        PyObject *message = PyString_FromFormat("expansion [%s] failed: %s", s, expand_string_message);
+        if (!message)
+            return NULL;
+
+        result = PyObject_CallFunctionObjArgs(expy_expansion_error, message, NULL);
+        Py_DECREF(message);
+        }
+
+    if (result && expy_expand_cache)
+        PyDict_SetItem(expy_expand_memo, str, result);
+
+    return result;
+    }
+
+
+/*
+ * Have Exim do a string expansion, will raise an ExpansionError
+ * (a subclass of ValueError) exception if the expansion fails
+ */
+static PyObject *expy_expand_string(PyObject *self, PyObject *args)
+    {
+    char *str;
+    uschar *result;
+
+    if (expy_expand_cache)
+        {
+        PyObject *arg;
+        PyObject *value;
+
+        if (!PyArg_ParseTuple(args, "O", &arg))
+            return NULL;
+
+        value = expy_expand_memoized(arg);   /* New reference */
+        if (value && !PyString_Check(value))
+            {
+            /* Failed before, raise the same error again */
+            PyErr_SetObject(expy_expansion_error, value);
+            Py_CLEAR(value);
+            }
+
+        return value;
+        }
+
+    if (!PyArg_ParseTuple(args, "s", &str))
+        return NULL;
+
+    result = expand_string((uschar *)str);
+
+    if (!result)
+        {
+        PyErr_Format(expy_expansion_error, "expansion [%s] failed: %s", str, expand_string_message);
+        return NULL;
+        }
+
+    return PyString_FromString((const char *)result);
+    }
+
+
+/*
+ * Expand a whole batch of strings.  Given a dict, the result has
+ * the same keys, with the expansions of the values.  Given any other
+ * iterable, the result is keyed by the strings themselves.
+ */
+static PyObject *expy_expand_many(PyObject *self, PyObject *args)
+    {
+    PyObject *strings;
+    PyObject *result;
+    PyObject *key;
+    PyObject *str;
+    PyObject *value = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &strings))
+        return NULL;
+
+    result = PyDict_New();  /* New reference */
+    if (!result)
+        return NULL;
+
+    if (PyDict_Check(strings))
+        {
+        Py_ssize_t pos = 0;
+
+        while (PyDict_Next(strings, &pos, &key, &str))
+            {
+            value = expy_expand_memoized(str);  /* New reference */
+            if (!value || (PyDict_SetItem(result, key, value) < 0))
+                goto failed;
+            Py_CLEAR(value);
+            }
+        }
+    else
+        {
+        PyObject *iter = PyObject_GetIter(strings);  /* New reference */
+        if (!iter)
+            goto failed;
+
+        while ((str = PyIter_Next(iter)))         /* New reference */
+            {
+            value = expy_expand_memoized(str);    /* New reference */
+            if (!value || (PyDict_SetItem(result, str, value) < 0))
+                {
+                Py_DECREF(str);
+                Py_DECREF(iter);
+                goto failed;
+                }
+            Py_CLEAR(value);
+            Py_DECREF(str);
+            }
+
+        Py_DECREF(iter);
+        if (PyErr_Occurred())
+            goto failed;
+        }
+
+    return result;
+
+failed:
+    Py_XDECREF(value);
+    Py_DECREF(result);
+    return NULL;
+    }
+
+
+/*
+ * Exim variables that exim.var() reads straight out of Exim's globals,
+ * rather than going through the expander.  Only globals local_scan.h
+ * declares can be read, so the likes of $tls_in_cipher,
+ * $authenticated_id and $acl_m... always go to Exim.  Of those, only
+ * ones whose expansion is nothing more than their value are listed -
+ * $sender_host_name for example may do a DNS lookup when expanded,
+ * so it's left to Exim.
+ */
+typedef struct
+    {
+    char *name;
+    uschar **str;      /* Either a string variable */
+    int *num;          /* or an integer one */
+    } expy_exim_var_t;
+
+static expy_exim_var_t expy_exim_vars[] =
+    {
+    { "body_linecount", NULL, &body_linecount },
+    { "body_zerocount", NULL, &body_zerocount },
+    { "interface_address", &interface_address, NULL },
+    { "interface_port", NULL, &interface_port },
+    { "message_id", &message_id, NULL },
+    { "received_protocol", &received_protocol, NULL },
+    { "recipients_count", NULL, &recipients_count },    /* or expy_recipients_live, see below */
+    { "sender_address", &sender_address, NULL },
+    { "sender_host_address", &sender_host_address, NULL },
+    { "sender_host_authenticated", &sender_host_authenticated, NULL },
+    { "sender_host_port", NULL, &sender_host_port },
+    };
+
+#define EXPY_EXIM_VAR_MAX 128   /* Longest variable name we'll look up */
+
+
+/*
+ * Value of $name as a string, the same as expanding "$name" would give,
+ * remembered until the end of the message (or until a header is added,
+ * since that can change $h_ variables).  Returns New reference, or NULL
+ * with ValueError set if the name is no good.
+ */
+static PyObject *expy_var_lookup(const char *name)
+    {
+    PyObject *result;
+    const char *p;
+    int i;
+
+    result = PyDict_GetItemString(expy_var_cache, name);  /* Borrowed reference */
+    if (result)
+        {
+        Py_INCREF(result);
+        return result;
+        }
+
+    /* Only plain variable names, nothing that means something else to the expander */
+    for (p = name; *p; p++)
+        if (!isalnum((unsigned char)*p) && (*p != '_'))
+            break;
+
+    if ((!*name) || *p || ((p - name) > EXPY_EXIM_VAR_MAX))
+        {
+        PyErr_Format(PyExc_ValueError, "invalid variable name [%s]", name);
+        return NULL;
+        }
+
+    for (i = 0; i < (int)(sizeof(expy_exim_vars)/sizeof(expy_exim_var_t)); i++)
+        if (!strcmp(name, expy_exim_vars[i].name))
+            break;
+
+    if (i < (int)(sizeof(expy_exim_vars)/sizeof(expy_exim_var_t)))
+        {
+        expy_exim_var_t *v = &expy_exim_vars[i];
+
+        /* Removals from exim.recipients don't reach Exim until the scan is done */
+        if ((v->num == &recipients_count) && (expy_recipients_live >= 0))
+            result = PyString_FromFormat("%d", expy_recipients_live);
+        else if (v->num)
+            result = PyString_FromFormat("%d", *(v->num));
+        else
+            result = PyString_FromString(*(v->str) ? (const char *)*(v->str) : "");
+        }
+    else
+        {
+        char buf[EXPY_EXIM_VAR_MAX + 2];
+        uschar *expanded;
+
+        buf[0] = '$';
+        strcpy(buf + 1, name);
+
+        expanded = expand_string((uschar *)buf);
+        if (!expanded)
+            {
+            PyErr_Format(expy_expansion_error, "expansion [%s] failed: %s", buf, expand_string_message);
+            return NULL;
+            }
+
+        result = PyString_FromString((const char *)expanded);
+        }
+
+    if (result)
+        PyDict_SetItemString(expy_var_cache, name, result);
+
+    return result;
+    }
+
+
+/*
+ * Get the value of an Exim variable, given its name without the '$'
+ */
+static PyObject *expy_var(PyObject *self, PyObject *args)
+    {
+    char *name;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    return expy_var_lookup(name);
+    }
+
+
+/*
+ * First header line with the given name, or None
+ */
+static PyObject *expy_get_header(PyObject *self, PyObject *args)
+    {
+    char *name;
+    PyObject *list;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    list = expy_header_index_lookup(name);  /* Borrowed reference */
+    if (!list)
+        return NULL;
+
+    for (i = 0; (list != Py_None) && (i < PyList_GET_SIZE(list)); i++)
+        {
+        expy_header_line_t *h = (expy_header_line_t *) PyList_GET_ITEM(list, i);
+
+        if (h->hline && (h->hline->type != '*'))
+            {
+            Py_INCREF(h);
+            return (PyObject *)h;
+            }
+        }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+/*
+ * List of all the header lines with the given name, in order
+ */
+static PyObject *expy_get_headers(PyObject *self, PyObject *args)
+    {
+    char *name;
+    PyObject *list;
+    PyObject *result;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    list = expy_header_index_lookup(name);  /* Borrowed reference */
+    if (!list)
+        return NULL;
+
+    result = PyList_New(0);                 /* New reference */
+    for (i = 0; result && (list != Py_None) && (i < PyList_GET_SIZE(list)); i++)
+        {
+        expy_header_line_t *h = (expy_header_line_t *) PyList_GET_ITEM(list, i);
+
+        if (h->hline && (h->hline->type != '*') && (PyList_Append(result, (PyObject *)h) < 0))
+            Py_CLEAR(result);
+        }
+
+    return result;
+    }
+
+
+/*
+ * Decode RFC 2047 encoded-words in a string, as for header.decoded,
+ * will raise a Python ValueError exception if that fails
+ */
+static PyObject *expy_decode_header(PyObject *self, PyObject *args)
+    {
+    char *str;
+
+    if (!PyArg_ParseTuple(args, "s", &str))
+        return NULL;
+
+    return expy_rfc2047_decode((uschar *)str, FALSE);
+    }
+
+
+/*
+ * Split an address at the last '@' into a (local_part, domain) tuple
+ */
+static PyObject *expy_split_address(PyObject *self, PyObject *args)
+    {
+    char *address;
+    const char *domain;
+
+    if (!PyArg_ParseTuple(args, "s", &address))
+        return NULL;
+
+    domain = expy_address_domain(address);
+    if (!domain)
+        return Py_BuildValue("(ss)", address, "");
+
+    return Py_BuildValue("(s#s)", address, (int)(domain - 1 - address), domain);
+    }
+
+
+/*
+ * Counters showing how well the caches are doing
+ */
+static PyObject *expy_stats(PyObject *self, PyObject *args)
+    {
+    return Py_BuildValue("{s:l,s:l,s:l,s:l}",
+                         "expand_cache_hits", expy_expand_hits,
+                         "expand_cache_misses", expy_expand_misses,
+                         "header_objects_allocated", expy_header_allocs,
+                         "header_objects_reused", expy_header_reuses);
+    }
+
+
+/*
+ * Add a header line, will automatically tack on a '\n' if necessary
+ */
+static PyObject *expy_header_add(PyObject *self, PyObject *args)
+    {
+    char *str;
+    PyObject *h;
+
+    if (!PyArg_ParseTuple(args, "s", &str))
+        return NULL;
+
+    header_add(' ', get_format_string(str, 1));
+    expy_expansions_changed();
+
+    h = expy_headers_added(header_last, expy_header_index != NULL);  /* Borrowed reference */
+    if (expy_header_index && (!h || !expy_header_index_add((expy_header_line_t *)h)))
+        {
+        PyErr_Clear();
+        Py_CLEAR(expy_header_index);   /* Rebuild it on the next lookup */
+        }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+/*
+ * Write to exim log, uses LOG_MAIN by default
+ */
+static PyObject *expy_log_write(PyObject *self, PyObject *args)
+    {
+    char *str;
+    int which = LOG_MAIN;
+
+    if (!PyArg_ParseTuple(args, "s|i", &str, &which))
+        return NULL;
+
+    log_write(0, which, "%s", get_format_string(str, 0));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+/*
+ * Print through Exim's debug_print() function, which does nothing if
+ * Exim isn't in debugging mode.
+ */
+static PyObject *expy_debug_print(PyObject *self, PyObject *args)
+    {
+    char *str;
+
+    if (!PyArg_ParseTuple(args, "s", &str))
+        return NULL;
+
+    debug_printf("%s", get_format_string(str, 0));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+/*
+ * Create a child process that runs the command specified.
+ * The return value is (stdout, stdin, pid), where stdout and stdin are file
+ * descriptors to the appropriate pipes (stderr is joined with stdout).
+ * The environment may be specified, and a new umask supplied.
+ */
+static PyObject *expy_child_open(PyObject *self, PyObject *args)
+    {
+    pid_t pid;
+    int infdptr;
+    int outfdptr;
+    PyObject * py_argv;
+    PyObject * py_envp;
+    int umask;
+    unsigned char make_leader = 0;
+    Py_ssize_t i;
+    Py_ssize_t argc;
+    uschar ** argv;
+    uschar ** envp;
+    Py_ssize_t envp_len;
+
+    /*
+     * The first two arguments are tuples of strings (argv, envp).
+     */
+    if (!PyArg_ParseTuple(args, "OOi|b", &py_argv, &py_envp, &umask, &make_leader))
+        return NULL;
+
+    argc = PySequence_Size(py_argv);
+    argv = PyMem_New(uschar *, argc + 1);
+    for (i=0; i<argc; ++i)
+        {
+        argv[i] = (uschar *)PyString_AsString(PyTuple_GET_ITEM(py_argv, i)); /* borrowed ref */
+        }
+    argv[argc] = NULL;
+    envp_len = PySequence_Size(py_envp);
+    envp = PyMem_New(uschar *, envp_len + 1);
+    for (i=0; i<envp_len; ++i)
+        {
+        envp[i] = (uschar *)PyString_AsString(PyTuple_GET_ITEM(py_envp, i)); /* borrowed ref */
+        }
+    envp[envp_len] = NULL;
+    pid = child_open(argv, envp, umask, &infdptr, &outfdptr, (BOOL) make_leader);
+    PyMem_Del(argv);
+    PyMem_Del(envp);
+    if (pid == -1)
+    {
+        /*
+         * An error occurred.
+         */
+        PyErr_Format(PyExc_OSError, "error %d", errno);
+        return NULL;
+    }
+
+    return Py_BuildValue("(iii)", infdptr, outfdptr, pid);
+    }
+
+/*
+ * Wait for a child process to terminate, or for a timeout (in seconds) to
+ * expire.  A timeout of zero (the default) means wait as long as it takes.
+ * The return value is the process ending status.
+ */
+static PyObject *expy_child_close(PyObject *self, PyObject *args)
+    {
+    int pid;
+    int timeout = 0;
+    int result;
+
+    if (!PyArg_ParseTuple(args, "i|i", &pid, &timeout))
+        return NULL;
+
+    result = child_close((pid_t) pid, timeout);
+
+    if (result < 0 && result > -256)
+    {
+        /*
+         * The process was ended by a signal.  The result is the negation
+         * of the signal number.
+         */
+        PyErr_Format(PyExc_OSError, "ended by signal %d", result * -1);
+        return NULL;
+    }
+    else if (result == -256)
+    {
+        /*
+         * The process timed out.
+         */
+        PyErr_Format(PyExc_OSError, "timed out");
+        return NULL;
+    }
+    else if (result < -256)
+    {
+        /*
+         * An error occurred.
+         */
+        PyErr_Format(PyExc_OSError, "error %d", errno);
+        return NULL;
+    }
+
+    return PyInt_FromLong(result);
+    }
+
+/*
+ * Note that this is the child_open_exim2 method from the Exim local_scan
+ * API - any child_open_exim call can be done through this method as well.
+ * Also, rather than returning a file descriptor, we take the message
+ * content as an argument, and write it out to the subprocess.  We still
+ * return the PID, so that execution can continue while Exim is processing
+ * the message if the caller so desires.
+ * Submit a new message to Exim, returning the PID of the subprocess.
+ * Essentially, this is running 'exim -t -oem -oi -f sender -oMas auth'
+ * (-oMas is omitted if no authentication is provided).
+ */
+static PyObject *expy_child_open_exim(PyObject *self, PyObject *args)
+    {
+    char *message;
+    int message_length;
+    char *sender = "";
+    char *sender_authentication = NULL;
+    pid_t exim_pid;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "s#|ss", &message, &message_length, &sender, &sender_authentication))
+        return NULL;
+
+    exim_pid = child_open_exim2(&fd, (uschar *) sender, (uschar *) sender_authentication);
+    if (write(fd, message, message_length) <= 0)
+    {
+        /*
+         * An error occurred.
+         */
+        PyErr_Format(PyExc_OSError, "error %d", errno);
+	close(fd);
+        return NULL;
+    }
+    close(fd);
+    return PyInt_FromLong(exim_pid);
+    }
+
+
+static PyMethodDef expy_exim_methods[] =
+    {
+    {"expand", expy_expand_string, METH_VARARGS, "Have exim expand string."},
+    {"expand_many", expy_expand_many, METH_VARARGS, "Have exim expand a batch of strings."},
+    {"var", expy_var, METH_VARARGS, "Get the value of an exim variable."},
+    {"decode_header", expy_decode_header, METH_VARARGS, "Decode RFC 2047 encoded-words in a string."},
+    {"split_address", expy_split_address, METH_VARARGS, "Split an address into local part and domain."},
+    {"get_header", expy_get_header, METH_VARARGS, "Get the first header line with a given name."},
+    {"get_headers", expy_get_headers, METH_VARARGS, "Get all the header lines with a given name."},
+    {"stats", expy_stats, METH_NOARGS, "Get counters for the caches."},
+    {"log", expy_log_write, METH_VARARGS, "Write message to exim log."},
+    {"add_header", expy_header_add, METH_VARARGS, "Add header to message."},
+    {"debug_print", expy_debug_print, METH_VARARGS, "Print if Exim is in debugging mode, otherwise do nothing."},
+    {"child_open", expy_child_open, METH_VARARGS, "Create a child process."},
+    {"child_close", expy_child_close, METH_VARARGS, "Wait for a child process to terminate."},
+    {"child_open_exim", expy_child_open_exim, METH_VARARGS, "Submit a message to Exim."},
+    {NULL, NULL, 0, NULL}
+    };
+
+
+/* ------------  Helper Functions for local_scan ---------- */
+
+/*
+ * Create an exception class in the exim module, returns New reference
+ */
+static PyObject *expy_create_exception(char *name, PyObject *base)
+    {
+    char buf[256];
+    PyObject *exc;
+
+    snprintf(buf, sizeof(buf), "%s.%s", expy_exim_module, name);
+    exc = PyErr_NewException(buf, base, NULL);   /* New reference */
+    if (exc)
+        PyDict_SetItemString(expy_exim_dict, name, exc);
+
+    return exc;
+    }
+
+
+/*
+ * Add an integer to the module dictionary
+ */
+static void expy_dict_int(char *key, int val)
+    {
+    PyObject *i;
+
+    i = PyInt_FromLong(val);
+    PyDict_SetItemString(expy_exim_dict, key, i);
+    Py_DECREF(i);
+    }
+
+/*
+ * Per-message variables - the Exim variables that are copied into the
+ * module dictionary for each message.  The object last stored for each
+ * is remembered, and only replaced if the Exim value has changed (or
+ * the Python code has replaced it), so a connection delivering several
+ * messages from the same host re-uses most of them.
+ */
+typedef struct
+    {
+    char *name;
+    uschar **str;      /* Either a string variable */
+    int *num;          /* or an integer one */
+    PyObject *value;   /* What we last put in the module dictionary */
+    } expy_message_var_t;
+
+static int expy_message_fd = -1;
+
+static expy_message_var_t expy_message_vars[] =
+    {
+    { "debug_selector", NULL, &debug_selector, NULL },
+    { "fd", NULL, &expy_message_fd, NULL },
+    { "host_checking", NULL, &host_checking, NULL },
+    { "interface_address", &interface_address, NULL, NULL },
+    { "interface_port", NULL, &interface_port, NULL },
+    { "message_id", &message_id, NULL, NULL },
+    { "received_protocol", &received_protocol, NULL, NULL },
+    { "sender_address", &sender_address, NULL, NULL },
+    { "sender_host_address", &sender_host_address, NULL, NULL },
+    { "sender_host_authenticated", &sender_host_authenticated, NULL, NULL },
+    { "sender_host_name", &sender_host_name, NULL, NULL },
+    { "sender_host_port", NULL, &sender_host_port, NULL },
+    };
+
+#define EXPY_MESSAGE_VARS ((int)(sizeof(expy_message_vars)/sizeof(expy_message_var_t)))
+
+
+/*
+ * Current value of a per-message variable, returns New reference
+ */
+static PyObject *expy_message_var_value(expy_message_var_t *v)
+    {
+    if (v->num)
+        return PyInt_FromLong(*(v->num));
+
+    if (*(v->str))
+        return PyString_FromString((const char *)*(v->str));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+static void expy_refresh_message_vars(int fd)
+    {
+    int i;
+
+    expy_message_fd = fd;
+
+    for (i = 0; i < EXPY_MESSAGE_VARS; i++)
+        {
+        expy_message_var_t *v = &expy_message_vars[i];
+        PyObject *value;
+
+        if (v->value && (PyDict_GetItemString(expy_exim_dict, v->name) == v->value))
+            {
+            if (v->num && (PyInt_AS_LONG(v->value) == *(v->num)))
+                continue;
+
+            if (v->str && !*(v->str) && (v->value == Py_None))
+                continue;
+
+            if (v->str && *(v->str) && PyString_Check(v->value)
+                && !strcmp(PyString_AS_STRING(v->value), (const char *)*(v->str)))
+                continue;
+            }
+
+        value = expy_message_var_value(v);  /* New reference */
+
+        PyDict_SetItemString(expy_exim_dict, v->name, value);
+        Py_XDECREF(v->value);
+        v->value = value;    /* Keep our reference */
+        }
+    }
+
+/* ------- Custom type for the message being scanned ------
+
+  With expy_scan_context set, the scan function is called with one
+  of these as its only argument.  It has the same per-message variables
+  as the exim module, as read-only attributes, but each one is only
+  converted to a Python object the first time it's asked for.  Like
+  header objects, it's no longer usable once its message is done.
+
+  The same object is used again for the next message, unless the
+  Python code has held on to it.
+
+*/
+
+typedef struct
+    {
+    PyObject_HEAD
+    BOOL valid;
+    PyObject *values[sizeof(expy_message_vars)/sizeof(expy_message_var_t)];  /* NULL until asked for */
+    PyObject *sender_parts[EXPY_ADDRESS_PARTS];                               /* Likewise */
+    } expy_message_t;
+
+
+static void expy_message_clear(expy_message_t *self)
+    {
+    int i;
+
+    for (i = 0; i < EXPY_MESSAGE_VARS; i++)
+        Py_CLEAR(self->values[i]);
+
+    expy_address_parts_clear(self->sender_parts);
+    }
+
+
+static void expy_message_dealloc(PyObject *self)
+    {
+    expy_message_clear((expy_message_t *)self);
+    PyObject_Del(self);
+    }
+
+
+static PyObject *expy_message_get(expy_message_t *self, void *closure)
+    {
+    expy_message_var_t *v = closure;
+    int i = v - expy_message_vars;
+
+    if (!self->valid)
+        {
+        PyErr_Format(PyExc_AttributeError, "Message object no longer valid, held over from previously processed message?");
+        return NULL;
+        }
+
+    if (!self->values[i])
+        {
+        self->values[i] = expy_message_var_value(v);
+        if (!self->values[i])
+            return NULL;
+        }
+
+    Py_INCREF(self->values[i]);
+    return self->values[i];
+    }
+
+
+/*
+ * sender_local_part, sender_domain and sender_domain_lower, which
+ * are None if sender_address is
+ */
+static PyObject *expy_message_get_sender_part(expy_message_t *self, void *closure)
+    {
+    if (!self->valid)
+        {
+        PyErr_Format(PyExc_AttributeError, "Message object no longer valid, held over from previously processed message?");
+        return NULL;
+        }
+
+    if (!sender_address)
+        {
+        Py_INCREF(Py_None);
+        return Py_None;
+        }
+
+    return expy_address_part((const char *)sender_address, self->sender_parts, (const char **)closure - expy_sender_part_names);
+    }
+
+
+/*
+ * Anything that isn't one of the per-message variables is looked
+ * up as an Exim variable, the same as exim.var() does.
+ */
+static PyObject *expy_message_getattro(expy_message_t *self, PyObject *name)
+    {
+    PyObject *result;
+    char *s;
+
+    result = PyObject_GenericGetAttr((PyObject *)self, name);
+    if (result || !self->valid || !PyErr_ExceptionMatches(PyExc_AttributeError))
+        return result;
+
+    s = PyString_AsString(name);
+    if (!s || (s[0] == '_'))
+        return NULL;
+
+    PyErr_Clear();
+    result = expy_var_lookup(s);
+    if (!result && PyErr_ExceptionMatches(PyExc_ValueError))
+        {
+        PyErr_Clear();
+        PyErr_Format(PyExc_AttributeError, "Unknown attribute: %s", s);
+        }
+
+    return result;
+    }
+
+
+static PyGetSetDef expy_message_getset[sizeof(expy_message_vars)/sizeof(expy_message_var_t) + EXPY_ADDRESS_PARTS + 1];
+
+static PyTypeObject ExPy_Message  =
+    {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /*ob_size*/
+    "ExPy Message",             /*tp_name*/
+    sizeof(expy_message_t),     /*tp_size*/
+    0,                          /*tp_itemsize*/
+    expy_message_dealloc,       /*tp_dealloc*/
+    };
+
+
+static expy_message_t *expy_message = NULL;     /* Object for the current or last message */
+static PyObject *expy_message_args = NULL;      /* Argument tuple holding it */
+
+
+/*
+ * Set up the message type, with an attribute for each of the
+ * per-message variables.  Returns FALSE on failure.
+ */
+static BOOL expy_message_type_init(void)
+    {
+    int i;
+
+    for (i = 0; i < EXPY_MESSAGE_VARS; i++)
+        {
+        expy_message_getset[i].name = expy_message_vars[i].name;
+        expy_message_getset[i].get = (getter) expy_message_get;
+        expy_message_getset[i].closure = &expy_message_vars[i];
+        }
+
+    for (i = 0; i < EXPY_ADDRESS_PARTS; i++)
+        {
+        expy_message_getset[EXPY_MESSAGE_VARS + i].name = (char *)expy_sender_part_names[i];
+        expy_message_getset[EXPY_MESSAGE_VARS + i].get = (getter) expy_message_get_sender_part;
+        expy_message_getset[EXPY_MESSAGE_VARS + i].closure = &expy_sender_part_names[i];
+        }
+
+    ExPy_Message.tp_flags = Py_TPFLAGS_DEFAULT;
+    ExPy_Message.tp_getset = expy_message_getset;
+    ExPy_Message.tp_getattro = (getattrofunc) expy_message_getattro;
+    return PyType_Ready(&ExPy_Message) == 0;
+    }
+
+
+/*
+ * Get the argument tuple for calling the scan function with a message
+ * object, re-using the last one if nothing else is holding on to it.
+ * Returns Borrowed reference, or NULL on failure.
+ */
+static PyObject *expy_message_begin(int fd)
+    {
+    expy_message_fd = fd;
+
+    if (expy_message && (Py_REFCNT(expy_message) == 2) && (Py_REFCNT(expy_message_args) == 1))
+        {
+        expy_message->valid = TRUE;
+        return expy_message_args;
+        }
+
+    /* Held over from an earlier message, so it stays invalid and we start afresh */
+    Py_CLEAR(expy_message_args);
+    Py_CLEAR(expy_message);
+
+    expy_message = PyObject_NEW(expy_message_t, &ExPy_Message);  /* New Reference */
+    if (!expy_message)
+        return NULL;
+
+    memset(expy_message->values, 0, sizeof(expy_message->values));
+    memset(expy_message->sender_parts, 0, sizeof(expy_message->sender_parts));
+    expy_message->valid = TRUE;
+
+    expy_message_args = PyTuple_Pack(1, expy_message);  /* New Reference */
+    return expy_message_args;
+    }
+
+
+/*
+ * Done with the message, drop the cached values
+ */
+static void expy_message_end(void)
+    {
+    if (!expy_message)
+        return;
+
+    expy_message->valid = FALSE;
+    expy_message_clear(expy_message);
+    }
+
+
+/*
+ * Make tuple containing message recipients
+ */
+static PyObject *get_recipients()
+    {
+    PyObject *result;
+    Py_ssize_t i;
+
+    result = PyTuple_New(recipients_count);
+    for (i = 0; i < recipients_count; i++)
+        PyTuple_SetItem(result, i, PyString_FromString((const char *)recipients_list[i].address));
+
+    return result;
+    }
+
+/*
+ * Make Exim's recipients match what the Python code left in its
+ * working list: original recipients no longer on it are removed, in
+ * one pass that closes up the gaps, and anything on it that wasn't
+ * an original recipient is added.  Sets are used for the membership
+ * tests, so this is linear in the number of recipients.  Returns FALSE
+ * with a Python exception set if the working list is unusable.
+ */
+static BOOL expy_reconcile_recipients(PyObject *original_recipients, PyObject *working_recipients)
+    {
+    PyObject *working_set;
+    PyObject *original_set;
+    PyObject *iter;
+    PyObject *addr;
+    int i, j;
+
+    working_set = PySet_New(working_recipients);     /* New reference */
+    if (!working_set)
+        return FALSE;
+
+    original_set = PySet_New(original_recipients);   /* New reference */
+    if (!original_set)
+        {
+        Py_DECREF(working_set);
+        return FALSE;
+        }
+
+    /* Remove original recipients not on the working list */
+    for (i = j = 0; i < recipients_count; i++)
+        {
+        addr = PyTuple_GET_ITEM(original_recipients, i);  /* Borrowed reference */
+        if (PySet_Contains(working_set, addr) == 1)
+            {
+            if (i != j)
+                recipients_list[j] = recipients_list[i];
+            j++;
+            }
+        }
+    recipients_count = j;
+
+    Py_DECREF(working_set);
+
+    /* Add new recipients not in the original list */
+    iter = PyObject_GetIter(working_recipients);      /* New reference */
+    if (!iter)
+        {
+        Py_DECREF(original_set);
+        return FALSE;
+        }
+
+    while ((addr = PyIter_Next(iter)))               /* New reference */
+        {
+        if (PySet_Contains(original_set, addr) != 1)
+            {
+            char *s = PyString_AsString(addr);
+            if (s)
+                receive_add_recipient(string_copy((uschar *)s), -1);
+            else
+                {
+                log_write(0, LOG_PANIC, "expy: ignoring recipient that isn't a string");
+                PyErr_Clear();
+                }
+            }
+        Py_DECREF(addr);
+        }
+
+    Py_DECREF(iter);
+    Py_DECREF(original_set);
+
+    return !PyErr_Occurred();
+    }
+
+
+/* ------- Sets of C strings ------
+
+  A small open-addressed hash table of C strings, for the bulk
+  recipient methods, so they can look addresses and domains up
+  without making a Python string out of each one.  It's sized
+  when it's set up for the most strings it'll hold, and the strings
+  aren't copied, so they have to outlive the set.
+
+*/
+
+typedef struct
+    {
+    const char *key;
+    PyObject *value;           /* Borrowed reference, or NULL */
+    Py_ssize_t index;
+    } expy_strset_entry_t;
+
+typedef struct
+    {
+    BOOL nocase;
+    size_t mask;
+    expy_strset_entry_t *table;
+    } expy_strset_t;
+
+
+static BOOL expy_strset_init(expy_strset_t *set, Py_ssize_t n, BOOL nocase)
+    {
+    size_t size;
+
+    for (size = 16; size < (size_t)n * 2; size *= 2)
+        ;
+
+    set->table = PyMem_Malloc(size * sizeof(expy_strset_entry_t));
+    if (!set->table)
+        {
+        PyErr_NoMemory();
+        return FALSE;
+        }
+
+    memset(set->table, 0, size * sizeof(expy_strset_entry_t));
+    set->mask = size - 1;
+    set->nocase = nocase;
+    return TRUE;
+    }
+
+
+static void expy_strset_free(expy_strset_t *set)
+    {
+    PyMem_Free(set->table);
+    set->table = NULL;
+    }
+
+
+/*
+ * Entry holding a string, or the empty one it would go in
+ */
+static expy_strset_entry_t *expy_strset_slot(expy_strset_t *set, const char *key)
+    {
+    const unsigned char *p;
+    size_t h = 2166136261U;
+    expy_strset_entry_t *e;
+
+    for (p = (const unsigned char *)key; *p; p++)
+        h = (h ^ (set->nocase ? tolower(*p) : *p)) * 16777619U;
+
+    for (e = set->table + (h & set->mask); e->key; e = set->table + (++h & set->mask))
+        if (!(set->nocase ? strcmpic((uschar *)e->key, (uschar *)key) : strcmp(e->key, key)))
+            break;
+
+    return e;
+    }
+
+
+/*
+ * Fill a set with the strings in a Python iterable.  Returns a New
+ * reference to a sequence of them, which has to be kept until the set
+ * is freed, or NULL on failure.
+ */
+static PyObject *expy_strset_fill(expy_strset_t *set, PyObject *iterable, BOOL nocase)
+    {
+    PyObject *items;
+    Py_ssize_t i;
+
+    /* Not its characters, which is what a single string would give */
+    if (PyString_Check(iterable) || PyUnicode_Check(iterable))
+        {
+        PyErr_SetString(PyExc_TypeError, "expected an iterable of strings, not a string");
+        return NULL;
+        }
+
+    items = PySequence_Fast(iterable, "expected an iterable of strings");  /* New reference */
+    if (!items)
+        return NULL;
+
+    if (!expy_strset_init(set, PySequence_Fast_GET_SIZE(items), nocase))
+        {
+        Py_DECREF(items);
+        return NULL;
+        }
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(items); i++)
+        {
+        char *s = PyString_AsString(PySequence_Fast_GET_ITEM(items, i));
+
+        if (!s)
+            {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_TypeError, "expected an iterable of strings");
+            expy_strset_free(set);
+            Py_DECREF(items);
+            return NULL;
+            }
+
+        expy_strset_slot(set, s)->key = s;
+        }
+
+    return items;
+    }
+
+
+/* ------- Custom type for the list of recipients ------
+
+  exim.recipients is one of these rather than a Python list.  It
+  looks like a list of address strings, read straight out of Exim's
+  recipients_list, and changes to it are kept track of as they're made
+  instead of being worked out by comparing lists afterwards:
+
+    - Added addresses are passed to receive_add_recipient() right away
+    - Removed ones are dropped from live[], the list of recipients_list
+      slots still in use, and closed up in one pass when the scan is done
+    - Replaced ones are remembered in a dict, and when the scan is done
+      their slots are closed up and the new addresses added at the end
+
+  If the scan function fails, recipients_list is put back how it was.
+  If the function replaces exim.recipients with something else, the
+  changes made through this object are undone, and the replacement
+  is compared with the original recipients instead, as it always was.
+
+  As with exim.headers, the same object is used for the next message
+  if nothing else is holding on to it, and nothing is done unless the
+  Python code looks at it.
+
+*/
+
+typedef struct
+    {
+    PyObject_HEAD
+    BOOL valid;
+    BOOL filled;               /* live[] has been set up for this message */
+    BOOL changed;              /* Recipients have been removed or replaced */
+    int original_count;        /* recipients_count before the scan */
+    Py_ssize_t count;          /* Number of entries in live[] */
+    Py_ssize_t size;           /* Room in live[] */
+    int *live;                 /* recipients_list slot of each recipient on the list, in order */
+    PyObject *replaced;        /* recipients_list slot -> new address, for replaced ones */
+    } expy_recipients_t;
+
+static expy_recipients_t *expy_recipients = NULL;   /* exim.recipients for the current or last message */
+
+
+static BOOL expy_recipients_valid(expy_recipients_t *self)
+    {
+    if (!self->valid)
+        {
+        PyErr_Format(PyExc_ValueError, "Recipients object no longer valid, held over from previously processed message?");
+        return FALSE;
+        }
+
+    return TRUE;
+    }
+
+
+/*
+ * Called whenever the list changes: anything worked out from the
+ * recipients (exim.var('recipients_count') for one) has to be again
+ */
+static void expy_recipients_changed(expy_recipients_t *self)
+    {
+    expy_recipients_live = self->count;
+    expy_expansions_changed();
+    }
+
+
+static BOOL expy_recipients_grow(expy_recipients_t *self, Py_ssize_t n)
+    {
+    int *live;
+    Py_ssize_t size;
+
+    if (n <= self->size)
+        return TRUE;
+
+    for (size = self->size ? self->size : 32; size < n; size *= 2)
+        ;
+
+    live = PyMem_Realloc(self->live, size * sizeof(int));
+    if (!live)
+        {
+        PyErr_NoMemory();
+        return FALSE;
+        }
+
+    self->live = live;
+    self->size = size;
+    return TRUE;
+    }
+
+
+/*
+ * Set up live[] from recipients_list, if that hasn't been done yet
+ * for this message, and check the object is still usable.
+ */
+static BOOL expy_recipients_ready(expy_recipients_t *self)
+    {
+    int i;
+
+    if (!expy_recipients_valid(self))
+        return FALSE;
+
+    if (self->filled)
+        return TRUE;
+
+    if (!expy_recipients_grow(self, recipients_count))
+        return FALSE;
+
+    for (i = 0; i < recipients_count; i++)
+        self->live[i] = i;
+
+    self->count = recipients_count;
+    self->filled = TRUE;
+    return TRUE;
+    }
+
+
+/*
+ * Address of the recipient at position i, taking replacements into account
+ */
+static const char *expy_recipients_address(expy_recipients_t *self, Py_ssize_t i)
+    {
+    if (self->replaced)
+        {
+        PyObject *key = PyInt_FromLong(self->live[i]);   /* New reference */
+        PyObject *addr = key ? PyDict_GetItem(self->replaced, key) : NULL;  /* Borrowed reference */
+
+        Py_XDECREF(key);
+        if (addr)
+            return PyString_AS_STRING(addr);
+        }
+
+    return (const char *)recipients_list[self->live[i]].address;
+    }
+
+
+/* ------- Custom type for a single recipient ------
+
+  What exim.recipients.item(i) returns: a view of one recipient_item,
+  for the fields besides the address.  It only holds the item's slot
+  in recipients_list (which doesn't move until the scan is done), plus
+  a reference to the recipients object to tell whether it's still
+  usable.  The address string and its parts are made the first time
+  they're asked for, and the other fields are read from the
+  recipient_item each time.
+
+  A recipient whose address has been replaced shows the new address,
+  and keeps the rest of the old one's fields.
+
+  Exims older than 4.86 have no DSN fields in recipient_item; build
+  with EXPY_NO_DSN defined for those, and dsn_flags and orcpt are left
+  out.
+
+*/
+
+typedef struct
+    {
+    PyObject_HEAD
+    expy_recipients_t *recipients;  /* The list it came from */
+    int slot;                       /* Position in recipients_list */
+    PyObject *address;
+    PyObject *parts[EXPY_ADDRESS_PARTS];
+    } expy_recipient_t;
+
+
+static recipient_item *expy_recipient_item(expy_recipient_t *self)
+    {
+    if (!self->recipients->valid)
+        {
+        PyErr_Format(PyExc_ValueError, "Recipient object no longer valid, held over from previously processed message?");
+        return NULL;
+        }
+
+    return recipients_list + self->slot;
+    }
+
+
+static PyObject *expy_recipient_string(const uschar *s)
+    {
+    if (!s)
+        {
+        Py_INCREF(Py_None);
+        return Py_None;
+        }
+
+    return PyString_FromString((const char *)s);
+    }
+
+
+static PyObject *expy_recipient_get_address(expy_recipient_t *self, void *closure)
+    {
+    recipient_item *r = expy_recipient_item(self);
+
+    if (!r)
+        return NULL;
+
+    if (!self->address)
+        {
+        self->address = PyString_FromString((const char *)r->address);
+        if (!self->address)
+            return NULL;
+        }
+
+    Py_INCREF(self->address);
+    return self->address;
+    }
+
+
+static PyObject *expy_recipient_get_part(expy_recipient_t *self, void *closure)
+    {
+    PyObject *address = expy_recipient_get_address(self, NULL);  /* New reference */
+    PyObject *result;
+
+    if (!address)
+        return NULL;
+
+    result = expy_address_part(PyString_AS_STRING(address), self->parts, (const char **)closure - expy_address_part_names);
+    Py_DECREF(address);
+    return result;
+    }
+
+
+static PyObject *expy_recipient_get_errors_to(expy_recipient_t *self, void *closure)
+    {
+    recipient_item *r = expy_recipient_item(self);
+
+    return r ? expy_recipient_string(r->errors_to) : NULL;
+    }
+
+
+static PyObject *expy_recipient_get_pno(expy_recipient_t *self, void *closure)
+    {
+    recipient_item *r = expy_recipient_item(self);
+
+    return r ? PyInt_FromLong(r->pno) : NULL;
+    }
+
+
+#ifndef EXPY_NO_DSN
+static PyObject *expy_recipient_get_dsn_flags(expy_recipient_t *self, void *closure)
+    {
+    recipient_item *r = expy_recipient_item(self);
+
+    return r ? PyInt_FromLong(r->dsn_flags) : NULL;
+    }
+
+
+static PyObject *expy_recipient_get_orcpt(expy_recipient_t *self, void *closure)
+    {
+    recipient_item *r = expy_recipient_item(self);
+
+    return r ? expy_recipient_string(r->orcpt) : NULL;
+    }
+#endif
+
+
+static PyObject *expy_recipient_repr(expy_recipient_t *self)
+    {
+    PyObject *address;
+    PyObject *result;
+
+    address = expy_recipient_get_address(self, NULL);    /* New reference */
+    if (!address)
+        return NULL;
+
+    result = PyString_FromFormat("<recipient %s>", PyString_AS_STRING(address));
+    Py_DECREF(address);
+    return result;
+    }
+
+
+static void expy_recipient_dealloc(PyObject *self)
+    {
+    expy_recipient_t *recipient = (expy_recipient_t *)self;
+
+    Py_XDECREF(recipient->address);
+    expy_address_parts_clear(recipient->parts);
+    Py_DECREF(recipient->recipients);
+    PyObject_Del(self);
+    }
+
+
+static PyGetSetDef expy_recipient_getset[] =
+    {
+    {"address", (getter) expy_recipient_get_address, NULL, "The recipient's address.", NULL},
+    {"local_part", (getter) expy_recipient_get_part, NULL, "Address up to the last '@'.", &expy_address_part_names[EXPY_LOCAL_PART]},
+    {"domain", (getter) expy_recipient_get_part, NULL, "Address after the last '@', or ''.", &expy_address_part_names[EXPY_DOMAIN]},
+    {"domain_lower", (getter) expy_recipient_get_part, NULL, "The domain, lowercased.", &expy_address_part_names[EXPY_DOMAIN_LOWER]},
+    {"errors_to", (getter) expy_recipient_get_errors_to, NULL, "Where delivery errors go, or None for the sender.", NULL},
+    {"pno", (getter) expy_recipient_get_pno, NULL, "Parent number for one_time aliases, or -1.", NULL},
+#ifndef EXPY_NO_DSN
+    {"dsn_flags", (getter) expy_recipient_get_dsn_flags, NULL, "DSN NOTIFY flags.", NULL},
+    {"orcpt", (getter) expy_recipient_get_orcpt, NULL, "DSN original recipient, or None.", NULL},
+#endif
+    {NULL}
+    };
+
+
+static PyTypeObject ExPy_Recipient  =
+    {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /*ob_size*/
+    "ExPy Recipient",           /*tp_name*/
+    sizeof(expy_recipient_t),   /*tp_size*/
+    0,                          /*tp_itemsize*/
+    expy_recipient_dealloc,     /*tp_dealloc*/
+    };
+
+
+static BOOL expy_recipient_type_init(void)
+    {
+    ExPy_Recipient.tp_flags = Py_TPFLAGS_DEFAULT;
+    ExPy_Recipient.tp_getset = expy_recipient_getset;
+    ExPy_Recipient.tp_repr = (reprfunc) expy_recipient_repr;
+    return PyType_Ready(&ExPy_Recipient) == 0;
+    }
+
+
+/*
+ * Recipient object for position i of the list (which must be in range)
+ */
+static PyObject *expy_recipient_new(expy_recipients_t *recipients, Py_ssize_t i)
+    {
+    expy_recipient_t *result;
+    PyObject *address = NULL;
+
+    if (recipients->replaced)
+        {
+        PyObject *key = PyInt_FromLong(recipients->live[i]);    /* New reference */
+
+        address = key ? PyDict_GetItem(recipients->replaced, key) : NULL;  /* Borrowed reference */
+        Py_XDECREF(key);
+        }
+
+    result = PyObject_NEW(expy_recipient_t, &ExPy_Recipient);  /* New Reference */
+    if (!result)
+        return NULL;
+
+    Py_INCREF(recipients);
+    result->recipients = recipients;
+    result->slot = recipients->live[i];
+    Py_XINCREF(address);
+    result->address = address;
+    memset(result->parts, 0, sizeof(result->parts));
+    return (PyObject *)result;
+    }
+
+
+/* ------- Methods of the list of recipients ------ */
+
+
+/*
+ * C string for an address passed to one of the methods, or NULL
+ * with TypeError set if it isn't a string
+ */
+static char *expy_recipients_arg(PyObject *value)
+    {
+    char *s = PyString_AsString(value);
+
+    if (!s)
+        {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_TypeError, "recipients can only be strings");
+        }
+
+    return s;
+    }
+
+
+/*
+ * Add a recipient to Exim's list, which is where its recipient_item is
+ * to be found straight afterwards (recipients_list[recipients_count - 1])
+ */
+static BOOL expy_recipients_add_string(expy_recipients_t *self, const char *s, int pno)
+    {
+    if (!expy_recipients_grow(self, self->count + 1))
+        return FALSE;
+
+    receive_add_recipient(string_copy((uschar *)s), pno);
+    self->live[self->count++] = recipients_count - 1;
+    expy_recipients_changed(self);
+    return TRUE;
+    }
+
+
+static BOOL expy_recipients_add(expy_recipients_t *self, PyObject *value)
+    {
+    char *s = expy_recipients_arg(value);
+
+    return s && expy_recipients_add_string(self, s, -1);
+    }
+
+
+static void expy_recipients_delete(expy_recipients_t *self, Py_ssize_t low, Py_ssize_t high)
+    {
+    if (high <= low)
+        return;
+
+    memmove(self->live + low, self->live + high, (self->count - high) * sizeof(int));
+    self->count -= high - low;
+    self->changed = TRUE;
+    expy_recipients_changed(self);
+    }
+
+
+static Py_ssize_t expy_recipients_length(expy_recipients_t *self)
+    {
+    if (!expy_recipients_ready(self))
+        return -1;
+
+    return self->count;
+    }
+
+
+static PyObject *expy_recipients_item(expy_recipients_t *self, Py_ssize_t i)
+    {
+    if (!expy_recipients_ready(self))
+        return NULL;
+
+    if ((i < 0) || (i >= self->count))
+        {
+        PyErr_SetString(PyExc_IndexError, "recipient index out of range");
+        return NULL;
+        }
+
+    return PyString_FromString(expy_recipients_address(self, i));
+    }
+
+
+static void expy_recipients_clamp(expy_recipients_t *self, Py_ssize_t *low, Py_ssize_t *high)
+    {
+    if (*low < 0)
+        *low = 0;
+    if (*low > self->count)
+        *low = self->count;
+    if (*high > self->count)
+        *high = self->count;
+    if (*high < *low)
+        *high = *low;
+    }
+
+
+static PyObject *expy_recipients_slice(expy_recipients_t *self, Py_ssize_t low, Py_ssize_t high)
+    {
+    PyObject *result;
+    Py_ssize_t i;
+
+    if (!expy_recipients_ready(self))
+        return NULL;
+
+    expy_recipients_clamp(self, &low, &high);
+
+    result = PyList_New(high - low);    /* New reference */
+    for (i = low; result && (i < high); i++)
+        {
+        PyObject *addr = PyString_FromString(expy_recipients_address(self, i));  /* New reference */
+        if (!addr)
+            {
+            Py_CLEAR(result);
+            break;
+            }
+
+        PyList_SET_ITEM(result, i - low, addr);
+        }
+
+    return result;
+    }
+
+
+/*
+ * Replace (or with a NULL value, remove) the recipient at position i
+ */
+static int expy_recipients_ass_item(expy_recipients_t *self, Py_ssize_t i, PyObject *value)
+    {
+    PyObject *key;
+    PyObject *addr;
+    char *s;
+    int rc;
+
+    if (!expy_recipients_ready(self))
+        return -1;
+
+    if ((i < 0) || (i >= self->count))
+        {
+        PyErr_SetString(PyExc_IndexError, "recipient assignment index out of range");
+        return -1;
+        }
+
+    if (!value)
+        {
+        expy_recipients_delete(self, i, i + 1);
+        return 0;
+        }
+
+    s = expy_recipients_arg(value);
+    if (!s)
+        return -1;
+
+    if (!strcmp(s, expy_recipients_address(self, i)))
+        return 0;
+
+    if (!self->replaced && !(self->replaced = PyDict_New()))
+        return -1;
+
+    key = PyInt_FromLong(self->live[i]);    /* New reference */
+    addr = PyString_FromString(s);          /* New reference */
+    rc = (key && addr) ? PyDict_SetItem(self->replaced, key, addr) : -1;
+    Py_XDECREF(key);
+    Py_XDECREF(addr);
+
+    if (rc == 0)
+        {
+        self->changed = TRUE;
+        expy_recipients_changed(self);
+        }
+
+    return rc;
+    }
+
+
+/*
+ * Add a copy of the recipient in a recipients_list slot to the end of
+ * the list, with a (possibly different) address but the same pno,
+ * errors_to and DSN fields
+ */
+static void expy_recipients_copy_item(int slot, const char *address)
+    {
+    recipient_item *r;
+
+    receive_add_recipient(string_copy((uschar *)address), recipients_list[slot].pno);
+
+    r = recipients_list + recipients_count - 1;
+    r->errors_to = recipients_list[slot].errors_to;
+#ifndef EXPY_NO_DSN
+    r->dsn_flags = recipients_list[slot].dsn_flags;
+    r->orcpt = recipients_list[slot].orcpt;
+#endif
+    }
+
+
+/*
+ * Delete a slice, or replace it with the contents of a sequence as long
+ * as the slice runs to the end (since new recipients can only go there).
+ *
+ * Addresses that were already in the slice keep their recipient_item,
+ * and so their pno, errors_to and DSN fields - in place while they're
+ * in their original order, since live[] has to stay in slot order, and
+ * after that as copies added at the end.
+ */
+static int expy_recipients_ass_slice(expy_recipients_t *self, Py_ssize_t low, Py_ssize_t high, PyObject *value)
+    {
+    expy_strset_t set;
+    PyObject *items;
+    Py_ssize_t n, i, k;
+    Py_ssize_t *next;
+    int *old;
+    int last;
+
+    if (!expy_recipients_ready(self))
+        return -1;
+
+    expy_recipients_clamp(self, &low, &high);
+
+    if (!value)
+        {
+        expy_recipients_delete(self, low, high);
+        return 0;
+        }
+
+    if (high != self->count)
+        {
+        PyErr_SetString(PyExc_TypeError, "recipients can only be added at the end");
+        return -1;
+        }
+
+    items = PySequence_List(value);     /* New reference, copied in case it's self */
+    if (!items)
+        return -1;
+
+    /* Check them all first, so that a bad one leaves the list alone */
+    for (k = 0; k < PyList_GET_SIZE(items); k++)
+        if (!expy_recipients_arg(PyList_GET_ITEM(items, k)))
+            {
+            Py_DECREF(items);
+            return -1;
+            }
+
+    n = high - low;
+    old = PyMem_Malloc((n + 1) * sizeof(int));
+    next = PyMem_Malloc((n + 1) * sizeof(Py_ssize_t));
+    if (!old || !next)
+        PyErr_NoMemory();
+
+    if (!old || !next || !expy_strset_init(&set, n, FALSE))
+        {
+        PyMem_Free(old);
+        PyMem_Free(next);
+        Py_DECREF(items);
+        return -1;
+        }
+
+    if (!expy_recipients_grow(self, low + PyList_GET_SIZE(items)))
+        {
+        expy_strset_free(&set);
+        PyMem_Free(old);
+        PyMem_Free(next);
+        Py_DECREF(items);
+        return -1;
+        }
+
+    /* Index the slots being replaced by address, duplicates chained in order */
+    for (i = n - 1; i >= 0; i--)
+        {
+        const char *s = expy_recipients_address(self, low + i);
+        expy_strset_entry_t *e = expy_strset_slot(&set, s);
+
+        old[i] = self->live[low + i];
+        next[i] = e->key ? e->index : -1;
+        e->key = s;
+        e->index = i;
+        }
+
+    last = low ? self->live[low - 1] : -1;
+    self->count = low;
+
+    for (k = 0; k < PyList_GET_SIZE(items); k++)
+        {
+        const char *s = PyString_AsString(PyList_GET_ITEM(items, k));
+        expy_strset_entry_t *e = expy_strset_slot(&set, s);
+        int slot = -1;
+
+        if (e->key && (e->index >= 0))
+            {
+            slot = old[e->index];
+            e->index = next[e->index];
+            }
+
+        if (slot > last)
+            self->live[self->count++] = slot;
+        else
+            {
+            if (slot >= 0)
+                expy_recipients_copy_item(slot, s);
+            else
+                receive_add_recipient(string_copy((uschar *)s), -1);
+
+            self->live[self->count++] = recipients_count - 1;
+            }
+
+        last = self->live[self->count - 1];
+        }
+
+    if (n)
+        self->changed = TRUE;
+    expy_recipients_changed(self);
+
+    expy_strset_free(&set);
+    PyMem_Free(old);
+    PyMem_Free(next);
+    Py_DECREF(items);
+    return 0;
+    }
+
+
+/*
+ * Position of an address, or -1
+ */
+static Py_ssize_t expy_recipients_find(expy_recipients_t *self, const char *s)
+    {
+    Py_ssize_t i;
+
+    for (i = 0; i < self->count; i++)
+        if (!strcmp(s, expy_recipients_address(self, i)))
+            return i;
+
+    return -1;
+    }
+
+
+static int expy_recipients_contains(expy_recipients_t *self, PyObject *value)
+    {
+    char *s;
+
+    if (!expy_recipients_ready(self))
+        return -1;
+
+    if (!PyString_Check(value) && !PyUnicode_Check(value))
+        return 0;
+
+    s = PyString_AsString(value);
+    if (!s)
+        return -1;
+
+    return expy_recipients_find(self, s) >= 0;
+    }
+
+
+static PyObject *expy_recipients_extend(expy_recipients_t *self, PyObject *value)
+    {
+    if (expy_recipients_ass_slice(self, PY_SSIZE_T_MAX, PY_SSIZE_T_MAX, value) < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+static PyObject *expy_recipients_inplace_concat(expy_recipients_t *self, PyObject *value)
+    {
+    if (expy_recipients_ass_slice(self, PY_SSIZE_T_MAX, PY_SSIZE_T_MAX, value) < 0)
+        return NULL;
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+    }
+
+
+static PyObject *expy_recipients_append(expy_recipients_t *self, PyObject *value)
+    {
+    if (!expy_recipients_ready(self) || !expy_recipients_add(self, value))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+static PyObject *expy_recipients_remove(expy_recipients_t *self, PyObject *value)
+    {
+    Py_ssize_t i;
+    char *s;
+
+    if (!expy_recipients_ready(self) || !(s = expy_recipients_arg(value)))
+        return NULL;
+
+    i = expy_recipients_find(self, s);
+    if (i < 0)
+        {
+        PyErr_SetString(PyExc_ValueError, "recipients.remove(x): x not in list");
+        return NULL;
+        }
+
+    expy_recipients_delete(self, i, i + 1);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+static PyObject *expy_recipients_pop(expy_recipients_t *self, PyObject *args)
+    {
+    Py_ssize_t i = -1;
+    PyObject *result;
+
+    if (!PyArg_ParseTuple(args, "|n", &i) || !expy_recipients_ready(self))
+        return NULL;
+
+    if (i < 0)
+        i += self->count;
+
+    result = expy_recipients_item(self, i);  /* New reference */
+    if (result)
+        expy_recipients_delete(self, i, i + 1);
+
+    return result;
+    }
+
+
+static PyObject *expy_recipients_index(expy_recipients_t *self, PyObject *value)
+    {
+    Py_ssize_t i;
+    char *s;
+
+    if (!expy_recipients_ready(self) || !(s = expy_recipients_arg(value)))
+        return NULL;
+
+    i = expy_recipients_find(self, s);
+    if (i < 0)
+        {
+        PyErr_SetString(PyExc_ValueError, "recipients.index(x): x not in list");
+        return NULL;
+        }
+
+    return PyInt_FromSsize_t(i);
+    }
+
+
+static PyObject *expy_recipients_count(expy_recipients_t *self, PyObject *value)
+    {
+    Py_ssize_t i, n;
+    char *s;
+
+    if (!expy_recipients_ready(self) || !(s = expy_recipients_arg(value)))
+        return NULL;
+
+    for (i = n = 0; i < self->count; i++)
+        if (!strcmp(s, expy_recipients_address(self, i)))
+            n++;
+
+    return PyInt_FromSsize_t(n);
+    }
+
+
+/*
+ * Add every address from an iterable, returning how many there were.
+ * If any of them isn't a string, none are added.
+ */
+static PyObject *expy_recipients_add_many(expy_recipients_t *self, PyObject *iterable)
+    {
+    PyObject *items;
+    Py_ssize_t i, n;
+
+    if (!expy_recipients_ready(self))
+        return NULL;
+
+    /* Not its characters, which is what a single string would give */
+    if (PyString_Check(iterable) || PyUnicode_Check(iterable))
+        {
+        PyErr_SetString(PyExc_TypeError, "expected an iterable of strings, not a string");
+        return NULL;
+        }
+
+    items = PySequence_Fast(iterable, "expected an iterable of strings");  /* New reference */
+    if (!items)
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE(items);
+    if (!expy_recipients_grow(self, self->count + n))
+        {
+        Py_DECREF(items);
+        return NULL;
+        }
+
+    for (i = 0; i < n; i++)
+        if (!expy_recipients_arg(PySequence_Fast_GET_ITEM(items, i)))
+            {
+            Py_DECREF(items);
+            return NULL;
+            }
+
+    for (i = 0; i < n; i++)
+        if (!expy_recipients_add(self, PySequence_Fast_GET_ITEM(items, i)))
+            {
+            Py_DECREF(items);
+            return NULL;
+            }
+
+    Py_DECREF(items);
+    return PyInt_FromSsize_t(n);
+    }
+
+
+/*
+ * Remove every recipient whose address (or with by_domain, whose domain,
+ * ignoring case) is in an iterable of strings, in one pass over live[].
+ * Returns the number removed.
+ */
+static PyObject *expy_recipients_remove_set(expy_recipients_t *self, PyObject *iterable, BOOL by_domain)
+    {
+    expy_strset_t set;
+    PyObject *items;
+    Py_ssize_t i, j;
+
+    if (!expy_recipients_ready(self))
+        return NULL;
+
+    items = expy_strset_fill(&set, iterable, by_domain);   /* New reference */
+    if (!items)
+        return NULL;
+
+    for (i = j = 0; i < self->count; i++)
+        {
+        const char *s = expy_recipients_address(self, i);
+
+        if (by_domain)
+            s = expy_address_domain(s);
+
+        if (s && expy_strset_slot(&set, s)->key)
+            continue;
+
+        self->live[j++] = self->live[i];
+        }
+
+    expy_strset_free(&set);
+    Py_DECREF(items);
+
+    i = self->count - j;
+    self->count = j;
+    if (i)
+        {
+        self->changed = TRUE;
+        expy_recipients_changed(self);
+        }
+
+    return PyInt_FromSsize_t(i);
+    }
+
+
+static PyObject *expy_recipients_remove_many(expy_recipients_t *self, PyObject *iterable)
+    {
+    return expy_recipients_remove_set(self, iterable, FALSE);
+    }
+
+
+static PyObject *expy_recipients_remove_where_domain_in(expy_recipients_t *self, PyObject *iterable)
+    {
+    return expy_recipients_remove_set(self, iterable, TRUE);
+    }
+
+
+/*
+ * Dict of lowercased domain -> list of the recipients in it, in order.
+ * Addresses without a domain go under ''.
+ */
+static PyObject *expy_recipients_partition_by_domain(expy_recipients_t *self)
+    {
+    expy_strset_t set;
+    PyObject *result;
+    Py_ssize_t i;
+
+    if (!expy_recipients_ready(self) || !expy_strset_init(&set, self->count, TRUE))
+        return NULL;
+
+    result = PyDict_New();  /* New reference */
+    for (i = 0; result && (i < self->count); i++)
+        {
+        const char *address = expy_recipients_address(self, i);
+        const char *domain = expy_address_domain(address);
+        expy_strset_entry_t *e;
+        PyObject *addr;
+
+        e = expy_strset_slot(&set, domain ? domain : "");
+        if (!e->key)
+            {
+            PyObject *key;
+            PyObject *list;
+            char *p;
+            int rc;
+
+            key = PyString_FromString(domain ? domain : "");  /* New reference */
+            list = PyList_New(0);                            /* New reference */
+            if (key)
+                for (p = PyString_AS_STRING(key); *p; p++)
+                    *p = tolower((unsigned char)*p);
+
+            rc = (key && list) ? PyDict_SetItem(result, key, list) : -1;
+            Py_XDECREF(key);
+            Py_XDECREF(list);       /* dict holds it now */
+            if (rc < 0)
+                {
+                Py_CLEAR(result);
+                break;
+                }
+
+            e->key = domain ? domain : "";
+            e->value = list;
+            }
+
+        addr = PyString_FromString(address);  /* New reference */
+        if (!addr || (PyList_Append(e->value, addr) < 0))
+            Py_CLEAR(result);
+        Py_XDECREF(addr);
+        }
+
+    expy_strset_free(&set);
+    return result;
+    }
+
+
+static PyObject *expy_recipients_item_object(expy_recipients_t *self, PyObject *args)
+    {
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "n", &i) || !expy_recipients_ready(self))
+        return NULL;
+
+    if (i < 0)
+        i += self->count;
+
+    if ((i < 0) || (i >= self->count))
+        {
+        PyErr_SetString(PyExc_IndexError, "recipient index out of range");
+        return NULL;
+        }
+
+    return expy_recipient_new(self, i);
+    }
+
+
+static PyObject *expy_recipients_items(expy_recipients_t *self)
+    {
+    PyObject *result;
+    Py_ssize_t i;
+
+    if (!expy_recipients_ready(self))
+        return NULL;
+
+    result = PyList_New(self->count);   /* New reference */
+    for (i = 0; result && (i < self->count); i++)
+        {
+        PyObject *recipient = expy_recipient_new(self, i);  /* New reference */
+        if (!recipient)
+            {
+            Py_CLEAR(result);
+            break;
+            }
+
+        PyList_SET_ITEM(result, i, recipient);
+        }
+
+    return result;
+    }
+
+
+/*
+ * Add a recipient along with the other recipient_item fields
+ */
+static PyObject *expy_recipients_add_full(expy_recipients_t *self, PyObject *args, PyObject *kwargs)
+    {
+    char *address;
+    char *errors_to = NULL;
+    int pno = -1;
+    recipient_item *r;
+#ifndef EXPY_NO_DSN
+    static char *kwlist[] = {"address", "errors_to", "pno", "dsn_flags", "orcpt", NULL};
+    int dsn_flags = 0;
+    char *orcpt = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|ziiz", kwlist, &address, &errors_to, &pno, &dsn_flags, &orcpt))
+        return NULL;
+#else
+    static char *kwlist[] = {"address", "errors_to", "pno", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|zi", kwlist, &address, &errors_to, &pno))
+        return NULL;
+#endif
+
+    if (!expy_recipients_ready(self) || !expy_recipients_add_string(self, address, pno))
+        return NULL;
+
+    r = recipients_list + recipients_count - 1;
+    if (errors_to)
+        r->errors_to = string_copy((uschar *)errors_to);
+#ifndef EXPY_NO_DSN
+    r->dsn_flags = dsn_flags;
+    if (orcpt)
+        r->orcpt = string_copy((uschar *)orcpt);
+#endif
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+/*
+ * Call a list method on a copy of the recipients, and make the copy
+ * the new contents through slice assignment, so recipients that are
+ * still there keep their fields.  For the list methods that reorder
+ * or insert, which this object can't do in place.
+ */
+static PyObject *expy_recipients_list_method(expy_recipients_t *self, char *name, PyObject *args, PyObject *kwargs)
+    {
+    PyObject *list;
+    PyObject *func;
+    PyObject *result = NULL;
+
+    list = expy_recipients_slice(self, 0, PY_SSIZE_T_MAX);  /* New reference */
+    if (!list)
+        return NULL;
+
+    func = PyObject_GetAttrString(list, name);   /* New reference */
+    if (func)
+        result = PyObject_Call(func, args, kwargs);  /* New reference */
+
+    if (result && (expy_recipients_ass_slice(self, 0, PY_SSIZE_T_MAX, list) < 0))
+        Py_CLEAR(result);
+
+    Py_XDECREF(func);
+    Py_DECREF(list);
+    return result;
+    }
+
+
+static PyObject *expy_recipients_sort(expy_recipients_t *self, PyObject *args, PyObject *kwargs)
+    {
+    return expy_recipients_list_method(self, "sort", args, kwargs);
+    }
+
+
+static PyObject *expy_recipients_reverse(expy_recipients_t *self, PyObject *args, PyObject *kwargs)
+    {
+    return expy_recipients_list_method(self, "reverse", args, kwargs);
+    }
+
+
+static PyObject *expy_recipients_insert(expy_recipients_t *self, PyObject *args, PyObject *kwargs)
+    {
+    return expy_recipients_list_method(self, "insert", args, kwargs);
+    }
+
+
+static PyObject *expy_recipients_repr(expy_recipients_t *self)
+    {
+    PyObject *list;
+    PyObject *result;
+
+    list = expy_recipients_slice(self, 0, PY_SSIZE_T_MAX);   /* New reference */
+    if (!list)
+        return NULL;
+
+    result = PyObject_Repr(list);
+    Py_DECREF(list);
+    return result;
+    }
+
+
+static void expy_recipients_dealloc(PyObject *self)
+    {
+    expy_recipients_t *recipients = (expy_recipients_t *)self;
+
+    Py_XDECREF(recipients->replaced);
+    PyMem_Free(recipients->live);
+    PyObject_Del(self);
+    }
+
+
+static PySequenceMethods expy_recipients_as_sequence =
+    {
+    (lenfunc) expy_recipients_length,               /*sq_length*/
+    0,                                              /*sq_concat*/
+    0,                                              /*sq_repeat*/
+    (ssizeargfunc) expy_recipients_item,            /*sq_item*/
+    (ssizessizeargfunc) expy_recipients_slice,      /*sq_slice*/
+    (ssizeobjargproc) expy_recipients_ass_item,     /*sq_ass_item*/
+    (ssizessizeobjargproc) expy_recipients_ass_slice, /*sq_ass_slice*/
+    (objobjproc) expy_recipients_contains,          /*sq_contains*/
+    (binaryfunc) expy_recipients_inplace_concat,    /*sq_inplace_concat*/
+    0,                                              /*sq_inplace_repeat*/
+    };
+
+
+static PyMethodDef expy_recipients_methods[] =
+    {
+    {"append", (PyCFunction) expy_recipients_append, METH_O, "Add a recipient."},
+    {"extend", (PyCFunction) expy_recipients_extend, METH_O, "Add a sequence of recipients."},
+    {"remove", (PyCFunction) expy_recipients_remove, METH_O, "Remove the first occurrence of a recipient."},
+    {"pop", (PyCFunction) expy_recipients_pop, METH_VARARGS, "Remove and return a recipient (the last one by default)."},
+    {"index", (PyCFunction) expy_recipients_index, METH_O, "Position of the first occurrence of a recipient."},
+    {"count", (PyCFunction) expy_recipients_count, METH_O, "Number of occurrences of a recipient."},
+    {"add_many", (PyCFunction) expy_recipients_add_many, METH_O, "Add the recipients from an iterable, returning how many."},
+    {"remove_many", (PyCFunction) expy_recipients_remove_many, METH_O, "Remove every occurrence of the addresses in an iterable, returning how many."},
+    {"remove_where_domain_in", (PyCFunction) expy_recipients_remove_where_domain_in, METH_O, "Remove the recipients in any of an iterable of domains (ignoring case), returning how many."},
+    {"partition_by_domain", (PyCFunction) expy_recipients_partition_by_domain, METH_NOARGS, "Dict of lowercased domain -> list of recipients."},
+    {"item", (PyCFunction) expy_recipients_item_object, METH_VARARGS, "Recipient object for a position in the list."},
+    {"items", (PyCFunction) expy_recipients_items, METH_NOARGS, "List of recipient objects."},
+    {"add", (PyCFunction) expy_recipients_add_full, METH_VARARGS | METH_KEYWORDS, "add(address, errors_to=None, pno=-1, dsn_flags=0, orcpt=None)"},
+    {"sort", (PyCFunction) expy_recipients_sort, METH_VARARGS | METH_KEYWORDS, "Sort the recipients, as list.sort() does."},
+    {"reverse", (PyCFunction) expy_recipients_reverse, METH_VARARGS | METH_KEYWORDS, "Reverse the recipients."},
+    {"insert", (PyCFunction) expy_recipients_insert, METH_VARARGS | METH_KEYWORDS, "Insert a recipient before a position."},
+    {NULL, NULL, 0, NULL}
+    };
+
+
+static PyTypeObject ExPy_Recipients  =
+    {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /*ob_size*/
+    "ExPy Recipients",          /*tp_name*/
+    sizeof(expy_recipients_t),  /*tp_size*/
+    0,                          /*tp_itemsize*/
+    expy_recipients_dealloc,    /*tp_dealloc*/
+    };
+
+
+/*
+ * One side of an operator as a list: a copy if it's a recipients
+ * object, otherwise itself.  Returns New reference.
+ */
+static PyObject *expy_recipients_operand(PyObject *o)
+    {
+    if (Py_TYPE(o) == &ExPy_Recipients)
+        return expy_recipients_slice((expy_recipients_t *)o, 0, PY_SSIZE_T_MAX);
+
+    Py_INCREF(o);
+    return o;
+    }
+
+
+/*
+ * exim.recipients + [...] and [...] + exim.recipients give a plain
+ * list, as they did when exim.recipients was one
+ */
+static PyObject *expy_recipients_concat(PyObject *a, PyObject *b)
+    {
+    PyObject *list_a;
+    PyObject *list_b;
+    PyObject *result = NULL;
+
+    list_a = expy_recipients_operand(a);                 /* New reference */
+    list_b = list_a ? expy_recipients_operand(b) : NULL;  /* New reference */
+    if (list_b)
+        result = PySequence_Concat(list_a, list_b);     /* New reference */
+
+    Py_XDECREF(list_b);
+    Py_XDECREF(list_a);
+    return result;
+    }
+
+
+static PyObject *expy_recipients_repeat(expy_recipients_t *self, Py_ssize_t n)
+    {
+    PyObject *list;
+    PyObject *result;
+
+    list = expy_recipients_slice(self, 0, PY_SSIZE_T_MAX);  /* New reference */
+    if (!list)
+        return NULL;
+
+    result = PySequence_Repeat(list, n);
+    Py_DECREF(list);
+    return result;
+    }
+
+
+/*
+ * Compare as a list of the addresses, so exim.recipients equals a
+ * list with the same addresses in the same order
+ */
+static PyObject *expy_recipients_richcompare(PyObject *a, PyObject *b, int op)
+    {
+    PyObject *list_a;
+    PyObject *list_b;
+    PyObject *result = NULL;
+
+    list_a = expy_recipients_operand(a);                 /* New reference */
+    list_b = list_a ? expy_recipients_operand(b) : NULL;  /* New reference */
+    if (list_b)
+        result = PyObject_RichCompare(list_a, list_b, op);  /* New reference */
+
+    Py_XDECREF(list_b);
+    Py_XDECREF(list_a);
+    return result;
+    }
+
+
+/*
+ * Indexing through the mapping protocol, for extended slices like
+ * exim.recipients[::-1] that sq_slice can't take
+ */
+static PyObject *expy_recipients_subscript(expy_recipients_t *self, PyObject *key)
+    {
+    Py_ssize_t start, stop, step, n, i;
+    PyObject *result;
+
+    if (PyIndex_Check(key))
+        {
+        i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (((i == -1) && PyErr_Occurred()) || !expy_recipients_ready(self))
+            return NULL;
+
+        if (i < 0)
+            i += self->count;
+
+        return expy_recipients_item(self, i);
+        }
+
+    if (!PySlice_Check(key))
+        {
+        PyErr_Format(PyExc_TypeError, "recipient indices must be integers, not %.200s", Py_TYPE(key)->tp_name);
+        return NULL;
+        }
+
+    if (!expy_recipients_ready(self)
+        || (PySlice_GetIndicesEx((PySliceObject *)key, self->count, &start, &stop, &step, &n) < 0))
+        return NULL;
+
+    result = PyList_New(n);     /* New reference */
+    for (i = 0; result && (i < n); i++, start += step)
+        {
+        PyObject *addr = PyString_FromString(expy_recipients_address(self, start));  /* New reference */
+        if (!addr)
+            {
+            Py_CLEAR(result);
+            break;
+            }
+
+        PyList_SET_ITEM(result, i, addr);
+        }
+
+    return result;
+    }
+
+
+static PyNumberMethods expy_recipients_as_number;
+static PyMappingMethods expy_recipients_as_mapping;
+
+
+static BOOL expy_recipients_type_init(void)
+    {
+    expy_recipients_as_number.nb_add = expy_recipients_concat;
+    expy_recipients_as_number.nb_inplace_add = (binaryfunc) expy_recipients_inplace_concat;
+    expy_recipients_as_sequence.sq_concat = expy_recipients_concat;
+    expy_recipients_as_sequence.sq_repeat = (ssizeargfunc) expy_recipients_repeat;
+    expy_recipients_as_mapping.mp_subscript = (binaryfunc) expy_recipients_subscript;
+
+    ExPy_Recipients.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES;
+    ExPy_Recipients.tp_as_number = &expy_recipients_as_number;
+    ExPy_Recipients.tp_as_sequence = &expy_recipients_as_sequence;
+    ExPy_Recipients.tp_as_mapping = &expy_recipients_as_mapping;
+    ExPy_Recipients.tp_methods = expy_recipients_methods;
+    ExPy_Recipients.tp_repr = (reprfunc) expy_recipients_repr;
+    ExPy_Recipients.tp_richcompare = expy_recipients_richcompare;
+    return PyType_Ready(&ExPy_Recipients) == 0;
+    }
+
+
+/*
+ * Get the recipients object for a new message, re-using the last one
+ * if nothing else is holding on to it.  Returns Borrowed reference,
+ * or NULL on failure.
+ */
+static PyObject *expy_recipients_begin(void)
+    {
+    expy_recipients_live = -1;
+
+    if (expy_recipients)
+        {
+        Py_ssize_t refs = 1;
+
+        if (PyDict_GetItemString(expy_exim_dict, "recipients") == (PyObject *)expy_recipients)
+            refs++;
+
+        if (Py_REFCNT(expy_recipients) != refs)
+            Py_CLEAR(expy_recipients);   /* Held over, so it stays invalid */
+        }
+
+    if (!expy_recipients)
+        {
+        expy_recipients = PyObject_NEW(expy_recipients_t, &ExPy_Recipients);  /* New Reference */
+        if (!expy_recipients)
+            return NULL;
+
+        expy_recipients->size = 0;
+        expy_recipients->live = NULL;
+        expy_recipients->replaced = NULL;
+        }
+
+    expy_recipients->valid = TRUE;
+    expy_recipients->filled = FALSE;
+    expy_recipients->changed = FALSE;
+    expy_recipients->count = 0;
+    expy_recipients->original_count = recipients_count;
+    return (PyObject *)expy_recipients;
+    }
+
+
+/*
+ * Undo any changes made through the recipients object
+ */
+static void expy_recipients_rollback(void)
+    {
+    if (expy_recipients && expy_recipients->filled)
+        recipients_count = expy_recipients->original_count;
+    }
+
+
+/*
+ * Apply the removals and replacements made through the recipients
+ * object to recipients_list (additions are there already)
+ */
+static void expy_recipients_commit(void)
+    {
+    expy_recipients_t *self = expy_recipients;
+    Py_ssize_t k;
+    int i, j, n;
+
+    if (!self || !self->filled || !self->changed)
+        return;
+
+    /*
+     * Replacements go on the end, in list order, with the rest of the
+     * fields of the recipients they replace - which are copied before
+     * the slots are closed up
+     */
+    n = recipients_count;
+    for (k = 0; self->replaced && (k < self->count); k++)
+        {
+        PyObject *key = PyInt_FromLong(self->live[k]);   /* New reference */
+        PyObject *addr = key ? PyDict_GetItem(self->replaced, key) : NULL;  /* Borrowed reference */
+
+        Py_XDECREF(key);
+        if (addr)
+            expy_recipients_copy_item(self->live[k], PyString_AS_STRING(addr));
+        }
+
+    /* live[] is in slot order, so one pass keeps the slots it lists */
+    for (i = j = 0, k = 0; i < n; i++)
+        {
+        if ((k < self->count) && (self->live[k] == i))
+            {
+            k++;
+            if (self->replaced)
+                {
+                PyObject *key = PyInt_FromLong(i);   /* New reference */
+                int replaced = key ? PyDict_Contains(self->replaced, key) : -1;
+
+                Py_XDECREF(key);
+                if (replaced == 1)
+                    continue;
+                }
+
+            if (i != j)
+                recipients_list[j] = recipients_list[i];
+            j++;
+            }
+        }
+
+    if (j < n)
+        memmove(recipients_list + j, recipients_list + n, (recipients_count - n) * sizeof(recipient_item));
+    recipients_count = j + (recipients_count - n);
+
+    PyErr_Clear();
+    }
+
+
+/*
+ * Done with the message
+ */
+static void expy_recipients_end(void)
+    {
+    expy_recipients_live = -1;
+
+    if (!expy_recipients)
+        return;
+
+    expy_recipients->valid = FALSE;
+    expy_recipients->filled = FALSE;
+    expy_recipients->count = 0;
+    Py_CLEAR(expy_recipients->replaced);
+    }
+
+
+/* ------- Shared code cache ------------
+
+ A file made by 'make_expy_bundle.py --cache', holding the marshalled
+ code of a set of modules, is mmapped read-only so that every process
+ on the machine shares the same copy in the page cache.  An object
+ of the type below goes at the front of sys.meta_path, and loads any
+ module found in the file straight from the mapping, as long as the
+ module's source file still has the modification time it had when
+ the cache was built - otherwise the normal import machinery takes
+ over.  All numbers in the file are 32-bit little-endian:
+
+   "EXPYCC1\0"  Python's magic number  entry count
+
+ followed by that many eight-number entries:
+
+   name offset, name length, source path offset, source path length,
+   flags (1 = package), source mtime, code offset, code length
+
+ and then the strings and code the offsets refer to.
+
+*/
+
+#define EXPY_CACHE_MAGIC      "EXPYCC1"
+#define EXPY_CACHE_HEADER     16
+#define EXPY_CACHE_ENTRY      32
+#define EXPY_CACHE_PACKAGE    1
+
+static const uschar *expy_cache_data = NULL;
+static size_t expy_cache_size = 0;
+static PyObject *expy_cache_index = NULL;  /* module name -> entry offset */
+
+
+static unsigned long expy_cache_uint(const uschar *p)
+    {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+    }
+
+
+/*
+ * Copy an entry's source path into buf, which must hold PATH_MAX
+ * bytes.  Returns FALSE if it's too long.
+ */
+static BOOL expy_cache_path(const uschar *entry, char *buf)
+    {
+    unsigned long len = expy_cache_uint(entry + 12);
+
+    if (len >= PATH_MAX)
+        return FALSE;
+
+    memcpy(buf, expy_cache_data + expy_cache_uint(entry + 8), len);
+    buf[len] = 0;
+    return TRUE;
+    }
+
+
+/*
+ * Return the cache entry for a module, or NULL if it's not
+ * in the cache, or the cached copy is out of date
+ */
+static const uschar *expy_cache_lookup(const char *fullname)
+    {
+    PyObject *offset;
+    const uschar *entry;
+    char path[PATH_MAX];
+    struct stat st;
+
+    offset = PyDict_GetItemString(expy_cache_index, fullname);  /* Borrowed reference */
+    if (!offset)
+        return NULL;
+
+    entry = expy_cache_data + PyInt_AS_LONG(offset);
+
+    if (!expy_cache_path(entry, path)
+        || (stat(path, &st) < 0)
+        || ((unsigned long)st.st_mtime != expy_cache_uint(entry + 20)))
+        return NULL;
+
+    return entry;
+    }
+
+
+static PyObject *expy_code_cache_find_module(PyObject *self, PyObject *args)
+    {
+    char *fullname;
+    PyObject *path = NULL;
+
+    if (!PyArg_ParseTuple(args, "s|O", &fullname, &path))
+        return NULL;
+
+    if (expy_cache_lookup(fullname))
+        {
+        Py_INCREF(self);
+        return self;
+        }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+    }
+
+
+static PyObject *expy_code_cache_load_module(PyObject *self, PyObject *args)
+    {
+    char *fullname;
+    const uschar *entry;
+    PyObject *module;
+    PyObject *code;
+    PyObject *result;
+    char path[PATH_MAX];
+
+    if (!PyArg_ParseTuple(args, "s", &fullname))
+        return NULL;
+
+    entry = expy_cache_lookup(fullname);
+    if (!entry)
+        {
+        PyErr_Format(PyExc_ImportError, "%s is no longer in the code cache", fullname);
+        return NULL;
+        }
+
+    expy_cache_path(entry, path);
+
+    module = PyImport_AddModule(fullname);  /* Borrowed reference */
+    if (!module)
+        return NULL;
+
+    Py_INCREF(self);
+    if (PyModule_AddObject(module, "__loader__", self))  /* Steals reference */
+        {
+        Py_DECREF(self);
+        return NULL;
+        }
+
+    if (expy_cache_uint(entry + 16) & EXPY_CACHE_PACKAGE)
+        {
+        char *slash = strrchr(path, '/');
+        PyObject *pkg_path = Py_BuildValue("[s#]", path, slash ? (int)(slash - path) : 0);  /* New reference */
+
+        if (!pkg_path || PyModule_AddObject(module, "__path__", pkg_path))  /* Steals reference */
+            return NULL;
+        }
+
+    code = PyMarshal_ReadObjectFromString((char *)(expy_cache_data + expy_cache_uint(entry + 24)),
+                                          expy_cache_uint(entry + 28));  /* New reference */
+    if (!code)
+        return NULL;
+
+    result = PyImport_ExecCodeModuleEx(fullname, code, path);  /* New reference */
+    Py_DECREF(code);
+    return result;
+    }
+
+
+static PyMethodDef expy_code_cache_methods[] =
+    {
+    {"find_module", expy_code_cache_find_module, METH_VARARGS, "Find a module in the code cache."},
+    {"load_module", expy_code_cache_load_module, METH_VARARGS, "Load a module from the code cache."},
+    {NULL, NULL, 0, NULL}
+    };
+
+
+static PyTypeObject ExPy_Code_Cache  =
+    {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /*ob_size*/
+    "ExPy Code Cache",          /*tp_name*/
+    sizeof(PyObject),           /*tp_size*/
+    };
+
+
+/*
+ * Map the code cache file and put a finder for it on sys.meta_path.
+ * Any problem is logged, and imports just carry on as normal.
+ */
+static void expy_code_cache_install(void)
+    {
+    int fd;
+    struct stat st;
+    unsigned long count, i;
+    PyObject *finder;
+    PyObject *meta_path;
+    void *data;
+
+    fd = open((const char *)expy_code_cache, O_RDONLY);
+    if (fd < 0)
+        {
+        log_write(0, LOG_PANIC, "expy: couldn't open code cache %s: %s", expy_code_cache, strerror(errno));
+        return;
+        }
+
+    if ((fstat(fd, &st) < 0) || (st.st_size < EXPY_CACHE_HEADER))
+        {
+        close(fd);
+        log_write(0, LOG_PANIC, "expy: code cache %s is too short", expy_code_cache);
+        return;
+        }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        {
+        log_write(0, LOG_PANIC, "expy: couldn't map code cache %s: %s", expy_code_cache, strerror(errno));
+        return;
+        }
+
+    expy_cache_data = data;
+    expy_cache_size = st.st_size;
+
+    if (memcmp(expy_cache_data, EXPY_CACHE_MAGIC, 8)
+        || (expy_cache_uint(expy_cache_data + 8) != ((unsigned long)PyImport_GetMagicNumber() & 0xffffffffUL)))
+        {
+        log_write(0, LOG_PANIC, "expy: code cache %s wasn't made by this version of Python", expy_code_cache);
+        goto fail;
+        }
+
+    count = expy_cache_uint(expy_cache_data + 12);
+    if (count > (expy_cache_size - EXPY_CACHE_HEADER) / EXPY_CACHE_ENTRY)
+        goto corrupt;
+
+    expy_cache_index = PyDict_New();
+    for (i = 0; i < count; i++)
+        {
+        size_t offset = EXPY_CACHE_HEADER + i * EXPY_CACHE_ENTRY;
+        const uschar *entry = expy_cache_data + offset;
+        PyObject *name;
+        PyObject *value;
+        int j;
+
+        /* every string or code block must lie within the file */
+        for (j = 0; j < EXPY_CACHE_ENTRY; j += 8)
+            {
+            unsigned long start = expy_cache_uint(entry + j);
+            unsigned long len = expy_cache_uint(entry + j + 4);
+
+            if (j == 16)
+                continue;  /* flags and mtime */
+
+            if ((start > expy_cache_size) || (len > expy_cache_size - start))
+                goto corrupt;
+            }
+
+        name = PyString_FromStringAndSize((const char *)(expy_cache_data + expy_cache_uint(entry)), expy_cache_uint(entry + 4));  /* New reference */
+        value = PyInt_FromSize_t(offset);  /* New reference */
+        PyDict_SetItem(expy_cache_index, name, value);
+        Py_DECREF(name);
+        Py_DECREF(value);
+        }
+
+    ExPy_Code_Cache.tp_flags = Py_TPFLAGS_DEFAULT;
+    ExPy_Code_Cache.tp_methods = expy_code_cache_methods;
+    if (PyType_Ready(&ExPy_Code_Cache) < 0)
+        goto python_fail;
+
+    finder = PyObject_New(PyObject, &ExPy_Code_Cache);  /* New reference */
+    meta_path = PySys_GetObject("meta_path");           /* Borrowed reference */
+    if (!finder || !meta_path || !PyList_Check(meta_path) || PyList_Insert(meta_path, 0, finder))
+        {
+        Py_XDECREF(finder);
+        goto python_fail;
+        }
+
+    Py_DECREF(finder);
+    return;
+
+corrupt:
+    log_write(0, LOG_PANIC, "expy: code cache %s is corrupt", expy_code_cache);
+    goto fail;
+
+python_fail:
+    PyErr_Clear();
+    log_write(0, LOG_PANIC, "expy: couldn't install code cache %s", expy_code_cache);
+
+fail:
+    Py_CLEAR(expy_cache_index);
+    munmap((void *)expy_cache_data, expy_cache_size);
+    expy_cache_data = NULL;
+    }
+
+
+/* ----------- Interpreter startup ------------ */
+
+/*
+ * Microseconds elapsed since the given time, for expy_log_timing
+ */
+static long expy_usec_since(struct timeval *start)
+    {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+    }
+
+
+char* getPythonTraceback()
+{
+    /* Python equivalent:
+
+       import traceback, sys
+       return "".join(traceback.format_exception(sys.exc_type,
+                                                 sys.exc_value,
+                                                 sys.exc_traceback))
+    */
+
+    PyObject *type, *value, *traceback;
+    PyObject *tracebackModule;
+    char *chrRetval;
+
+    PyErr_Fetch(&type, &value, &traceback);
+
+    tracebackModule = PyImport_ImportModule("traceback");
+    if (tracebackModule != NULL)
+    {
+        PyObject *tbList, *emptyString, *strRetval;
+
+        tbList = PyObject_CallMethod(
+            tracebackModule,
+            "format_exception",
+            "OOO",
+            type,
+            value == NULL ? Py_None : value,
+            traceback == NULL ? Py_None : traceback);
+
+        emptyString = PyString_FromString("");
+        strRetval = PyObject_CallMethod(emptyString, "join",
+            "O", tbList);
+
+        chrRetval = strdup(PyString_AsString(strRetval));
+
+        Py_DECREF(tbList);
+        Py_DECREF(emptyString);
+        Py_DECREF(strRetval);
+        Py_DECREF(tracebackModule);
+    }
+    else
+    {
+        /* Usually expy_path leaving out the standard library, so at
+           least say what the original exception was */
+        PyObject *strValue;
+
+        PyErr_Clear();
+        log_write(0, LOG_PANIC, "expy: can't import the traceback module, does expy_path include the Python standard library?");
+
+        strValue = value ? PyObject_Str(value) : NULL;
+        if (!strValue)
+            PyErr_Clear();
+
+        chrRetval = malloc(256);
+        if (chrRetval)
+            snprintf(chrRetval, 256, "Unable to import traceback module. %s: %s",
+                PyType_Check(type) ? ((PyTypeObject *)type)->tp_name : "exception",
+                strValue ? PyString_AsString(strValue) : "");
+
+        Py_XDECREF(strValue);
+    }
+
+    Py_DECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+
+    return chrRetval;
+}
+
+
+/*
+ * Replace sys.path with the colon-separated list of
+ * directories in expy_path
+ */
+static void expy_set_path(void)
+    {
+    PyObject *path;
+    char *start = (char *)expy_path;
+
+    path = PyList_New(0);  /* New reference */
+
+    while (start)
+        {
+        char *end = strchr(start, ':');
+        Py_ssize_t len = end ? (end - start) : (Py_ssize_t)strlen(start);
+
+        if (len)
+            {
+            PyObject *item = PyString_FromStringAndSize(start, len);  /* New reference */
+            PyList_Append(path, item);
+            Py_DECREF(item);
+            }
+
+        start = end ? end + 1 : NULL;
+        }
+
+    if (PySys_SetObject("path", path))
+        {
+        PyErr_Clear();
+        log_write(0, LOG_PANIC, "expy: Failed to set Python sys.path to [%s]", expy_path);
+        }
+
+    Py_DECREF(path);
+    }
+
+
+/*
+ * Start the interpreter and create the exim module, unless that's
+ * already been done by an earlier local_scan() call or inherited
+ * from a preloading daemon.
+ */
+static void expy_init_python(void)
+    {
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+
+    if (!Py_IsInitialized())
+        {
+        /* It is definitely cleanest to set a program name here.
+        However, it's not really clear *what* name to use. In many ways,
+        Exim would be most accurate, but that will not necessarily be the
+        starting location for finding libraries that is wanted.
+        So it's up to the expy_program_name setting, which defaults
+        to /usr/local/bin/python. */
+        Py_SetProgramName((char *)expy_program_name);
+
+        if (expy_isolated)
+            {
+            Py_IgnoreEnvironmentFlag = 1;
+#if PY_VERSION_HEX >= 0x02060000
+            Py_NoUserSiteDirectory = 1;
+#endif
+            }
+
+        if (!expy_site)
+            Py_NoSiteFlag = 1;
+
+        Py_Initialize();
+        ExPy_Header_Line.ob_type = &PyType_Type;
+
+        if (expy_path)
+            expy_set_path();
+        }
+
+    if (!expy_exim_dict)
+        {
+        PyObject *module = Py_InitModule((const char *)expy_exim_module, expy_exim_methods); /* Borrowed reference */
+        Py_INCREF(module);                                 /* convert to New reference */
+        expy_exim_dict = PyModule_GetDict(module);         /* Borrowed reference */
+        Py_INCREF(expy_exim_dict);                         /* convert to New reference */
+
+        expy_empty_tuple = PyTuple_New(0);                 /* New reference */
+        expy_var_cache = PyDict_New();                     /* New reference */
+        expy_expand_memo = PyDict_New();                   /* New reference */
+
+        expy_expansion_error = expy_create_exception("ExpansionError", PyExc_ValueError);
+        if (!expy_expansion_error)
+            {
+            PyErr_Clear();
+            expy_expansion_error = PyExc_ValueError;
+            Py_INCREF(expy_expansion_error);
+            }
+
+        if (!expy_header_line_type_init() || !expy_headers_type_init()
+            || !expy_recipients_type_init() || !expy_recipient_type_init())
+            {
+            PyErr_Clear();
+            log_write(0, LOG_PANIC, "expy: couldn't set up the header and recipient object types");
+            }
+
+        if (!expy_message_type_init())
+            {
+            PyErr_Clear();
+            log_write(0, LOG_PANIC, "expy: couldn't set up the message object type");
+            }
+
+        /* constants, which don't change from one message to the next */
+        expy_dict_int("LOG_MAIN", LOG_MAIN);
+        expy_dict_int("LOG_PANIC", LOG_PANIC);
+        expy_dict_int("LOG_REJECT", LOG_REJECT);
+
+        expy_dict_int("LOCAL_SCAN_ACCEPT", LOCAL_SCAN_ACCEPT);
+        expy_dict_int("LOCAL_SCAN_ACCEPT_FREEZE", LOCAL_SCAN_ACCEPT_FREEZE);
+        expy_dict_int("LOCAL_SCAN_ACCEPT_QUEUE", LOCAL_SCAN_ACCEPT_QUEUE);
+        expy_dict_int("LOCAL_SCAN_REJECT", LOCAL_SCAN_REJECT);
+        expy_dict_int("LOCAL_SCAN_REJECT_NOLOGHDR", LOCAL_SCAN_REJECT_NOLOGHDR);
+        expy_dict_int("LOCAL_SCAN_TEMPREJECT", LOCAL_SCAN_TEMPREJECT);
+        expy_dict_int("LOCAL_SCAN_TEMPREJECT_NOLOGHDR", LOCAL_SCAN_TEMPREJECT_NOLOGHDR);
+        expy_dict_int("MESSAGE_ID_LENGTH", MESSAGE_ID_LENGTH);
+        expy_dict_int("SPOOL_DATA_START_OFFSET", SPOOL_DATA_START_OFFSET);
+
+        expy_dict_int("D_v", D_v);
+        expy_dict_int("D_local_scan", D_local_scan);
+
+        expy_init_usec = expy_usec_since(&start);
+        }
+    }
+
+
+/*
+ * Modification time of the file the scan module was loaded from,
+ * or 0 if that can't be found.  For a module loaded from a .pyc
+ * file, the .py file next to it is checked if there is one, and
+ * for one loaded from the expy_bundle archive, that archive.
+ */
+static time_t expy_get_module_mtime(void)
+    {
+    PyObject *file;
+    char path[PATH_MAX];
+    size_t len;
+    struct stat st;
+
+    file = PyObject_GetAttrString(expy_user_module, "__file__");  /* New reference */
+    if (!file || !PyString_Check(file) || ((len = PyString_GET_SIZE(file)) >= sizeof(path)))
+        {
+        PyErr_Clear();
+        Py_XDECREF(file);
+        return 0;
+        }
+
+    strcpy(path, PyString_AS_STRING(file));
+    Py_DECREF(file);
+
+    if ((len > 4) && (!strcmp(path + len - 4, ".pyc") || !strcmp(path + len - 4, ".pyo")))
+        {
+        path[len - 1] = 0;
+        if (stat(path, &st) == 0)
+            return st.st_mtime;
+        path[len - 1] = 'c';
+        }
+
+    if (stat(path, &st) == 0)
+        return st.st_mtime;
+
+    if (expy_bundle && (stat((const char *)expy_bundle, &st) == 0))
+        return st.st_mtime;
+
+    return 0;
+    }
+
+
+/*
+ * Whether a directory is already on sys.path
+ */
+static BOOL expy_path_contains(PyObject *sys_path, PyObject *entry)
+    {
+    int rc = PySequence_Contains(sys_path, entry);
+
+    if (rc < 0)
+        PyErr_Clear();
+
+    return rc == 1;
+    }
+
+
+/*
+ * Extend sys.path if asked to, and import the user's scan module
+ * into expy_user_module.  Problems are logged to the paniclog,
+ * returns FALSE if the module isn't available.
+ */
+static BOOL expy_import_user_module(void)
+    {
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+
+    if (expy_code_cache && !expy_cache_index)
+        expy_code_cache_install();
+
+    /*
+     * Put the bundle at the front of sys.path, so zipimport finds
+     * everything in it without looking anywhere else first.  This is
+     * tried again if the import fails, so it may be there already.
+     */
+    if (expy_bundle)
+        {
+        PyObject *sys_path = PySys_GetObject("path");  /* Borrowed reference */
+        PyObject *bundle_value = PyString_FromString((const char *)expy_bundle);  /* New reference */
+
+        if (!sys_path || !PyList_Check(sys_path) || !bundle_value
+            || (!expy_path_contains(sys_path, bundle_value) && PyList_Insert(sys_path, 0, bundle_value)))
+            {
+            PyErr_Clear();
+            log_write(0, LOG_PANIC, "expy: Failed to add bundle [%s] to Python sys.path", expy_bundle);
+            }
+
+        Py_XDECREF(bundle_value);
+        }
+
+    if (expy_path_add)
+        {
+        PyObject *sys_module;
+        PyObject *sys_dict;
+        PyObject *sys_path;
+        PyObject *add_value;
+
+        sys_module = PyImport_ImportModule("sys");  /* New Reference */
+        if (!sys_module)
+            {
+            log_write(0, LOG_PANIC, "Couldn't import Python 'sys' module");
+            log_write(0, LOG_PANIC, "%s", getPythonTraceback());
+            return FALSE;
+            }
+
+        sys_dict = PyModule_GetDict(sys_module);               /* Borrowed Reference, never fails */
+        sys_path = PyMapping_GetItemString(sys_dict, "path");  /* New reference */
+
+        if (!sys_path || (!PyList_Check(sys_path)))
+            {
+            log_write(0, LOG_PANIC, "expy: Python sys.path doesn't exist or isn't a list");
+            log_write(0, LOG_PANIC, "%s", getPythonTraceback());
+            return FALSE;
+            }
+
+        add_value = PyString_FromString((const char *)expy_path_add);  /* New reference */
+        if (!add_value)
+            {
+            PyErr_Clear();
+            log_write(0, LOG_PANIC, "expy: Failed to create Python string from [%s]", expy_path_add);
+            return FALSE;
+            }
+
+        if (!expy_path_contains(sys_path, add_value) && PyList_Append(sys_path, add_value))
+            {
+            PyErr_Clear();
+            log_write(0, LOG_PANIC, "expy: Failed to append [%s] to Python sys.path", expy_path_add);
+            }
+
+        Py_DECREF(add_value);
+        Py_DECREF(sys_path);
+        Py_DECREF(sys_module);
+        }
+
+    expy_user_module = PyImport_ImportModule((const char *)expy_scan_module);  /* New Reference */
+
+    if (!expy_user_module)
+        {
+        PyErr_Clear();
+        log_write(0, LOG_PANIC, "Couldn't import Python '%s' module", expy_scan_module);
+        return FALSE;
+        }
+
+    /* A missing function is reported by local_scan() */
+    expy_user_func = PyObject_GetAttrString(expy_user_module, (char *)expy_scan_function);  /* New reference */
+    if (!expy_user_func)
+        PyErr_Clear();
+
+    expy_module_mtime = expy_get_module_mtime();
+
+    if (expy_log_timing)
+        log_write(0, LOG_MAIN, "expy: Python startup: init %ldus, import %ldus", expy_init_usec, expy_usec_since(&start));
+
+    return TRUE;
+    }
+
+
+/* ---------- Reloading the scan module -------------
+
+ With expy_reload_interval set, local_scan() (and with expy_preload,
+ the daemon each time it forks) looks at most that often to see
+ whether the file the scan module came from has changed, and if so
+ imports it again from scratch.  The new version only replaces the
+ old one if it imports cleanly and has a scan function, otherwise
+ scanning carries on with the old one, and that version of the file
+ isn't tried again.  Modules the scan module itself imports aren't
+ reloaded.  In the daemon the import runs as the daemon's user, like
+ the preload itself.
+
+*/
+
+static void expy_check_reload(void)
+    {
+    time_t now = time(NULL);
+    time_t mtime;
+    PyObject *sys_modules;
+    PyObject *old_module;
+    PyObject *new_module;
+    PyObject *func;
+    struct timeval start;
+
+    if ((expy_reload_interval <= 0) || (now - expy_reload_checked < expy_reload_interval))
+        return;
+
+    expy_reload_checked = now;
+
+    mtime = expy_get_module_mtime();
+    if (!mtime || (mtime == expy_module_mtime) || (mtime == expy_reload_failed))
+        return;
+
+    gettimeofday(&start, NULL);
+
+    /* An archive replaced on disk needs zipimport to forget what it knew about it */
+    if (expy_bundle)
+        {
+        PyObject *zipimport = PyImport_ImportModule("zipimport");  /* New reference */
+        PyObject *zip_cache = zipimport ? PyObject_GetAttrString(zipimport, "_zip_directory_cache") : NULL;  /* New reference */
+        PyObject *importer_cache = PySys_GetObject("path_importer_cache");  /* Borrowed reference */
+
+        if (zip_cache && PyDict_Check(zip_cache))
+            PyDict_DelItemString(zip_cache, (const char *)expy_bundle);
+        if (importer_cache && PyDict_Check(importer_cache))
+            PyDict_DelItemString(importer_cache, (const char *)expy_bundle);
+
+        PyErr_Clear();
+        Py_XDECREF(zip_cache);
+        Py_XDECREF(zipimport);
+        }
+
+    sys_modules = PyImport_GetModuleDict();  /* Borrowed reference */
+    old_module = expy_user_module;
+    PyDict_DelItemString(sys_modules, (const char *)expy_scan_module);
+    PyErr_Clear();
+
+    new_module = PyImport_ImportModule((const char *)expy_scan_module);  /* New reference */
+    func = new_module ? PyObject_GetAttrString(new_module, (char *)expy_scan_function) : NULL;  /* New reference */
+
+    if (!func)
+        {
+        log_write(0, LOG_MAIN|LOG_PANIC, "expy: reloading Python '%s' module failed, still using the previous version", expy_scan_module);
+        log_write(0, LOG_PANIC, "%s", getPythonTraceback());
+
+        PyDict_SetItemString(sys_modules, (const char *)expy_scan_module, old_module);
+        Py_XDECREF(new_module);
+        expy_reload_failed = mtime;
+        return;
+        }
+
+    Py_XDECREF(expy_user_func);
+    expy_user_func = func;
+    expy_user_module = new_module;
+    expy_module_mtime = mtime;
+    Py_DECREF(old_module);
+
+    log_write(0, LOG_MAIN, "expy: reloaded Python '%s' module in %ldus", expy_scan_module, expy_usec_since(&start));
+    }
+
+
+/* ---------- Preloading in the Exim daemon -------------
+
+ Exim has no hook for running local_scan code in the listening
+ daemon, but the daemon has always read its configuration by the
+ time it first calls fork().  So a constructor notes whether this
+ process is a daemon (-bd or -bdf on the command line) and registers
+ a fork handler.  If expy_preload is set, the first fork in the
+ daemon starts Python and imports the scan module, and every
+ receiving process forked afterwards inherits the warm interpreter.
+ Later forks first check whether the module needs reloading, so a
+ new version is imported once by the daemon and inherited, rather
+ than by each receiving process on its first message.
+
+ Note the import then happens as the user the daemon runs as
+ (usually root), and before any message is being processed.  It also
+ runs inside a pthread_atfork() prepare handler, in the middle of the
+ daemon's fork() call: the daemon is single threaded, so nothing else
+ is holding locks, and expy_preload_tried is set first, so a module
+ that forks while it's being imported (through subprocess, say)
+ doesn't start a second preload.  Even so, keep the module's
+ import-time work simple.
+
+ Finding the command line relies on glibc, which passes argc and argv
+ to constructors as an extension.  Other C libraries don't, so there
+ the constructor isn't built and expy_preload does nothing (local_scan
+ logs that it's set).
+
+*/
+
+/*
+ * Write a mainlog line showing how much of this process's memory
+ * is private to it and how much is shared with related processes,
+ * as reported by Linux in /proc/self/smaps_rollup.  Silently
+ * does nothing where that isn't available.
+ */
+static void expy_log_memory(const char *when)
+    {
+    FILE *f;
+    char line[256];
+    unsigned long val;
+    unsigned long rss = 0, pss = 0, shared = 0, private = 0;
+
+    f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+        return;
+
+    while (fgets(line, sizeof(line), f))
+        {
+        if (sscanf(line, "Rss: %lu", &val) == 1)
+            rss = val;
+        else if (sscanf(line, "Pss: %lu", &val) == 1)
+            pss = val;
+        else if ((sscanf(line, "Shared_Clean: %lu", &val) == 1) || (sscanf(line, "Shared_Dirty: %lu", &val) == 1))
+            shared += val;
+        else if ((sscanf(line, "Private_Clean: %lu", &val) == 1) || (sscanf(line, "Private_Dirty: %lu", &val) == 1))
+            private += val;
+        }
+
+    fclose(f);
+
+    log_write(0, LOG_MAIN, "expy: memory %s: rss=%lukB pss=%lukB uss=%lukB shared=%lukB", when, rss, pss, private, shared);
+    expy_memory_reported = getpid();
+    }
+
+
+#ifdef __GLIBC__
+
+/*
+ * Run a full collection so everything that survived startup ends up
+ * in the oldest generation.  Python 2 has no gc.freeze(), but this
+ * does most of the same job: a full collection only happens again
+ * once the objects created since outnumber a quarter of those
+ * long-lived ones, so a receiving process rarely walks (and thereby
+ * copies) the pages holding the inherited objects.
+ */
+static void expy_gc_collect(void)
+    {
+    PyGC_Collect();
+    PyErr_Clear();
+    }
+
+
+static void expy_preload_prepare(void)
+    {
+    PyObject *old_module;
+
+    if (!expy_is_daemon || !expy_enabled || !expy_preload || expy_scan_socket)
+        return;
+
+    if (expy_preload_tried)
+        {
+        if (!expy_user_module)
+            return;
+
+        old_module = expy_user_module;
+        expy_check_reload();
+        if (expy_user_module != old_module)
+            expy_gc_collect();
+        return;
+        }
+
+    expy_preload_tried = TRUE;
+
+    expy_init_python();
+
+    if (!expy_user_module && !expy_import_user_module())
+        log_write(0, LOG_MAIN, "expy: preloading Python '%s' module failed, will retry when scanning", expy_scan_module);
+
+    expy_gc_collect();
+
+    if (expy_memory_report)
+        expy_log_memory("after preload");
+    }
+
+
+static void expy_preload_child(void)
+    {
+    if (Py_IsInitialized())
+        PyOS_AfterFork();
+    }
+
+
+static void __attribute__((constructor)) expy_constructor(int argc, char **argv, char **envp)
+    {
+    int i;
+
+    for (i = 1; i < argc; i++)
+        if (strncmp(argv[i], "-bd", 3) == 0)
+            expy_is_daemon = TRUE;
+
+    if (expy_is_daemon)
+        pthread_atfork(expy_preload_prepare, NULL, expy_preload_child);
+    }
+
+#endif
+
+
+/* ---------- Scanning through expy_scan_daemon.py -------------
+
+ With expy_scan_socket set, Python isn't started in Exim at all.  The
+ message is handed to a pool of worker processes over a Unix socket,
+ one connection per message:
+
+   - a single byte protocol version ('1'), carrying the spool file
+     descriptor as SCM_RIGHTS ancillary data
+
+   - an 'R' frame with the constants, variables, headers and recipients
+
+ and then frames from the worker are handled until an 'E' (the Python
+ code failed, here's the traceback) or 'V' (verdict) frame arrives.  In
+ the meantime the worker may ask for string expansions ('X', answered
+ with 'x') and write to the logs ('L' and 'D').
+
+ With expy_forkserver set, the request is sent as an 'F' frame instead,
+ asking the worker to fork a child process for this one scan.  The child
+ reports how long the fork took in a 'T' frame.
+
+ A frame is a one byte type followed by a 32-bit payload length.  Within
+ the payload integers are 32-bit, strings are a 32-bit length followed by
+ that many bytes (0xffffffff meaning None), all in network byte order.
+ The exact layout of each frame is in expy_scan_daemon.py.
+
+*/
+
+#define EXPY_NONE_LENGTH 0xffffffffU
+
+/* Writing to a daemon that has gone away fails with EPIPE rather than
+   killing the receiving process with SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define EXPY_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define EXPY_SEND_FLAGS 0
+#endif
+
+typedef struct
+    {
+    uschar *data;
+    size_t len;
+    size_t size;
+    BOOL failed;   /* Set if memory ran out, the frame then isn't sent */
+    } expy_buffer_t;
+
+typedef struct
+    {
+    uschar *data;
+    size_t len;
+    size_t pos;
+    BOOL ok;       /* Cleared if the frame was too short for what's been read */
+    } expy_reader_t;
+
+
+static void expy_put(expy_buffer_t *b, const void *p, size_t n)
+    {
+    uschar *data;
+
+    if (b->failed)
+        return;
+
+    if (b->len + n > b->size)
+        {
+        data = realloc(b->data, (b->len + n) * 2);
+        if (!data)
+            {
+            b->failed = TRUE;
+            return;
+            }
+        b->data = data;
+        b->size = (b->len + n) * 2;
+        }
+
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    }
+
+
+static void expy_put_int(expy_buffer_t *b, int i)
+    {
+    uint32_t n = htonl((uint32_t)i);
+    expy_put(b, &n, 4);
+    }
+
+
+static void expy_put_string(expy_buffer_t *b, const uschar *s)
+    {
+    if (!s)
+        {
+        expy_put_int(b, (int)EXPY_NONE_LENGTH);
+        return;
+        }
+
+    expy_put_int(b, (int)strlen((const char *)s));
+    expy_put(b, s, strlen((const char *)s));
+    }
+
+
+static BOOL expy_take(expy_reader_t *r, void *p, size_t n)
+    {
+    if (!r->ok || (r->len - r->pos < n))
+        {
+        r->ok = FALSE;
+        memset(p, 0, n);
+        return FALSE;
+        }
+
+    memcpy(p, r->data + r->pos, n);
+    r->pos += n;
+    return TRUE;
+    }
+
+
+static int expy_get_int(expy_reader_t *r)
+    {
+    uint32_t n;
+    expy_take(r, &n, 4);
+    return (int)ntohl(n);
+    }
+
+
+static int expy_get_byte(expy_reader_t *r)
+    {
+    uschar ch;
+    expy_take(r, &ch, 1);
+    return ch;
+    }
+
+
+/*
+ * Returns a copy in Exim's store, or NULL for None
+ */
+static uschar *expy_get_string(expy_reader_t *r)
+    {
+    uint32_t n = (uint32_t)expy_get_int(r);
+    uschar *s;
+
+    if (!r->ok || (n == EXPY_NONE_LENGTH))
+        return NULL;
+
+    if (r->len - r->pos < n)
+        {
+        r->ok = FALSE;
+        return NULL;
+        }
+
+    s = store_get(n + 1, 0);
+    memcpy(s, r->data + r->pos, n);
+    s[n] = 0;
+    r->pos += n;
+    return s;
+    }
 
-    if (!PyArg_ParseTuple(args, "s#|ss", &message, &message_length, &sender, &sender_authentication))
-        return NULL;
 
-    exim_pid = child_open_exim2(&fd, (uschar *) sender, (uschar *) sender_authentication);
-    if (write(fd, message, message_length) <= 0)
+static BOOL expy_write_all(int sock, const void *p, size_t n)
     {
-        /*
-         * An error occurred.
-         */
-        PyErr_Format(PyExc_OSError, "error %d", errno);
-	close(fd);
-        return NULL;
-    }
-    close(fd);
-    return PyInt_FromLong(exim_pid);
+    const uschar *q = p;
+
+    while (n)
+        {
+        ssize_t done = send(sock, q, n, EXPY_SEND_FLAGS);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return FALSE;
+        q += done;
+        n -= done;
+        }
+
+    return TRUE;
     }
 
 
-static PyMethodDef expy_exim_methods[] =
+static BOOL expy_read_all(int sock, void *p, size_t n)
     {
-    {"expand", expy_expand_string, METH_VARARGS, "Have exim expand string."},
-    {"log", expy_log_write, METH_VARARGS, "Write message to exim log."},
-    {"add_header", expy_header_add, METH_VARARGS, "Add header to message."},
-    {"debug_print", expy_debug_print, METH_VARARGS, "Print if Exim is in debugging mode, otherwise do nothing."},
-    {"child_open", expy_child_open, METH_VARARGS, "Create a child process."},
-    {"child_close", expy_child_close, METH_VARARGS, "Wait for a child process to terminate."},
-    {"child_open_exim", expy_child_open_exim, METH_VARARGS, "Submit a message to Exim."},
-    {NULL, NULL, 0, NULL}
-    };
+    uschar *q = p;
 
+    while (n)
+        {
+        ssize_t done = read(sock, q, n);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done == 0)
+            errno = 0;  /* Closed by the other end */
+        if (done <= 0)
+            return FALSE;
+        q += done;
+        n -= done;
+        }
 
-/* ------------  Helper Functions for local_scan ---------- */
+    return TRUE;
+    }
 
-/*
- * Add a string to the module dictionary
- */
-static void expy_dict_string(char *key, uschar *val)
+
+static BOOL expy_send_frame(int sock, int type, expy_buffer_t *b)
     {
-    PyObject *s;
+    uschar head[5];
+    uint32_t n = htonl((uint32_t)b->len);
 
-    if (val)
-        s = PyString_FromString((const char *)val);
-    else
+    if (b->failed)
         {
-        s = Py_None;
-        Py_INCREF(s);
+        errno = ENOMEM;
+        return FALSE;
         }
 
-    PyDict_SetItemString(expy_exim_dict, key, s);
-    Py_DECREF(s);
+    head[0] = (uschar)type;
+    memcpy(head + 1, &n, 4);
+
+    return expy_write_all(sock, head, 5) && expy_write_all(sock, b->data, b->len);
     }
 
+
 /*
- * Add an integer to the module dictionary
+ * Read a frame, the caller frees r->data when done with it
  */
-static void expy_dict_int(char *key, int val)
+static BOOL expy_recv_frame(int sock, int *type, expy_reader_t *r)
     {
-    PyObject *i;
+    uschar head[5];
+    uint32_t n;
 
-    i = PyInt_FromLong(val);
-    PyDict_SetItemString(expy_exim_dict, key, i);
-    Py_DECREF(i);
+    if (!expy_read_all(sock, head, 5))
+        return FALSE;
+
+    *type = head[0];
+    memcpy(&n, head + 1, 4);
+
+    r->len = ntohl(n);
+    r->pos = 0;
+    r->ok = TRUE;
+    r->data = malloc(r->len ? r->len : 1);
+
+    if (!r->data)
+        return FALSE;
+
+    if (!expy_read_all(sock, r->data, r->len))
+        {
+        free(r->data);
+        r->data = NULL;
+        return FALSE;
+        }
+
+    return TRUE;
     }
 
+
 /*
- * Convert Exim header linked-list to Python list
- * of header objects.
- *
- * Returns New reference
+ * Connect to the daemon and pass it the spool file descriptor,
+ * returns the socket or -1
  */
-static PyObject *get_headers()
+static int expy_daemon_connect(int fd)
     {
-    header_line *p;
-    PyObject *result;
+    struct sockaddr_un addr;
+    struct timeval tv;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char version = '1';
+    int sock;
+
+    if (Ustrlen(expy_scan_socket) >= sizeof(addr.sun_path))
+        {
+        errno = ENAMETOOLONG;
+        return -1;
+        }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, (const char *)expy_scan_socket);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
 
-    /* Build up the list of tuples */
-    result = PyList_New(0);           /* New reference */
-    for (p = header_list; p; p = p->next)
+    if (expy_scan_timeout > 0)
         {
-        PyList_Append(result, expy_create_header_line(p));   /* Steals new reference */
+        tv.tv_sec = expy_scan_timeout;
+        tv.tv_usec = 0;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
         }
 
-    return result;
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+        {
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+        }
+#endif
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+        close(sock);
+        return -1;
+        }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = &version;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, EXPY_SEND_FLAGS) != 1)
+        {
+        close(sock);
+        return -1;
+        }
+
+    return sock;
     }
 
-/*
- * Given the header tuple created by get_headers(), go through
- * and set the header objects to point to NULL, in case someone
- * tries to re-use them after a message is done being processed, and
- * the underlying header strings are no longer available
- */
-static void clear_headers(PyObject *exim_headers)
+
+static void expy_daemon_request(expy_buffer_t *b)
     {
+    header_line *h;
     int i, n;
 
-    n = PyList_Size(exim_headers);
-    for (i = 0; i < n; i++)
+    /* Same order as CONSTANTS, INT_VARIABLES and STRING_VARIABLES in expy_scan_daemon.py */
+    expy_put_int(b, LOG_MAIN);
+    expy_put_int(b, LOG_PANIC);
+    expy_put_int(b, LOG_REJECT);
+    expy_put_int(b, LOCAL_SCAN_ACCEPT);
+    expy_put_int(b, LOCAL_SCAN_ACCEPT_FREEZE);
+    expy_put_int(b, LOCAL_SCAN_ACCEPT_QUEUE);
+    expy_put_int(b, LOCAL_SCAN_REJECT);
+    expy_put_int(b, LOCAL_SCAN_REJECT_NOLOGHDR);
+    expy_put_int(b, LOCAL_SCAN_TEMPREJECT);
+    expy_put_int(b, LOCAL_SCAN_TEMPREJECT_NOLOGHDR);
+    expy_put_int(b, MESSAGE_ID_LENGTH);
+    expy_put_int(b, SPOOL_DATA_START_OFFSET);
+    expy_put_int(b, D_v);
+    expy_put_int(b, D_local_scan);
+
+    expy_put_int(b, debug_selector);
+    expy_put_int(b, host_checking);
+    expy_put_int(b, interface_port);
+    expy_put_int(b, sender_host_port);
+
+    expy_put_string(b, interface_address);
+    expy_put_string(b, message_id);
+    expy_put_string(b, received_protocol);
+    expy_put_string(b, sender_address);
+    expy_put_string(b, sender_host_address);
+    expy_put_string(b, sender_host_authenticated);
+    expy_put_string(b, sender_host_name);
+
+    for (n = 0, h = header_list; h; h = h->next)
+        n++;
+    expy_put_int(b, n);
+    for (h = header_list; h; h = h->next)
         {
-        expy_header_line_t *p;
-
-        p = (expy_header_line_t *) PyList_GetItem(exim_headers, i); /* Borrowed reference */
-        p->hline = NULL;
+        uschar type = (uschar)h->type;
+        expy_put(b, &type, 1);
+        expy_put_string(b, h->text);
         }
 
+    expy_put_int(b, recipients_count);
+    for (i = 0; i < recipients_count; i++)
+        expy_put_string(b, recipients_list[i].address);
     }
 
 
 /*
- * Make tuple containing message recipients
+ * Read the number of items in a list, each taking at least
+ * min_size bytes, failing unless the rest of the frame could
+ * hold that many
  */
-static PyObject *get_recipients()
+static int expy_get_count(expy_reader_t *r, size_t min_size)
     {
-    PyObject *result;
-    Py_ssize_t i;
+    int n = expy_get_int(r);
 
-    result = PyTuple_New(recipients_count);
-    for (i = 0; i < recipients_count; i++)
-        PyTuple_SetItem(result, i, PyString_FromString((const char *)recipients_list[i].address));
+    if (r->ok && ((n < 0) || ((size_t)n > (r->len - r->pos) / min_size)))
+        r->ok = FALSE;
 
-    return result;
+    return r->ok ? n : 0;
     }
 
+
 /*
- * shift entries in list down to overwrite
- * entry in slot n (0-based)
+ * Apply a 'V' frame to the message.  The whole frame is read and
+ * checked before anything is changed, so if it's malformed FALSE is
+ * returned and the message is left as it was.
  */
-static void expy_remove_recipient(int n)
+static BOOL expy_daemon_verdict(expy_reader_t *r, int *rc, uschar **return_text)
     {
-    int i;
-    for (i = n; i < (recipients_count-1); i ++)
-        recipients_list[i] = recipients_list[i+1];
+    header_line **hlines = NULL;
+    header_line *h;
+    uschar *text;
+    int *type_index = NULL;
+    int *type_value = NULL;
+    int *added_type = NULL;
+    uschar **added_text = NULL;
+    int *removed = NULL;
+    uschar **added_rcpt = NULL;
+    int verdict;
+    int type_count, header_count, removed_count, rcpt_count;
+    int hcount, i, j, k;
+
+    verdict = expy_get_int(r);
+    text = expy_get_string(r);
+
+    for (hcount = 0, h = header_list; h; h = h->next)
+        hcount++;
+
+    /* header type changes, by position in the header list */
+    type_count = expy_get_count(r, 5);
+    type_index = malloc((type_count ? type_count : 1) * sizeof(int));
+    type_value = malloc((type_count ? type_count : 1) * sizeof(int));
+    if (!type_index || !type_value)
+        r->ok = FALSE;
+
+    for (i = 0; r->ok && (i < type_count); i++)
+        {
+        type_index[i] = expy_get_int(r);
+        type_value[i] = expy_get_byte(r);
 
-    recipients_count--;
-    }
+        if ((type_index[i] < 0) || (type_index[i] >= hcount))
+            r->ok = FALSE;
+        }
 
+    /* added headers */
+    header_count = expy_get_count(r, 5);
+    added_type = malloc((header_count ? header_count : 1) * sizeof(int));
+    added_text = malloc((header_count ? header_count : 1) * sizeof(uschar *));
+    if (!added_type || !added_text)
+        r->ok = FALSE;
 
-/* ----------- Actual local_scan function ------------ */
+    for (i = 0; r->ok && (i < header_count); i++)
+        {
+        added_type[i] = expy_get_byte(r);
+        added_text[i] = expy_get_string(r);
 
-char* getPythonTraceback()
-{
-    /* Python equivalent:
+        if (!added_text[i])
+            r->ok = FALSE;
+        }
 
-       import traceback, sys
-       return "".join(traceback.format_exception(sys.exc_type,
-                                                 sys.exc_value,
-                                                 sys.exc_traceback))
-    */
+    /* removed recipients, indexes in ascending order */
+    removed_count = expy_get_count(r, 4);
+    if (removed_count > recipients_count)
+        r->ok = FALSE;
 
-    PyObject *type, *value, *traceback;
-    PyObject *tracebackModule;
-    char *chrRetval;
+    removed = malloc((removed_count ? removed_count : 1) * sizeof(int));
+    if (!removed)
+        r->ok = FALSE;
 
-    PyErr_Fetch(&type, &value, &traceback);
+    for (i = 0; r->ok && (i < removed_count); i++)
+        {
+        removed[i] = expy_get_int(r);
+        if ((removed[i] < 0) || (removed[i] >= recipients_count) || (i && (removed[i] <= removed[i-1])))
+            r->ok = FALSE;
+        }
 
-    tracebackModule = PyImport_ImportModule("traceback");
-    if (tracebackModule != NULL)
-    {
-        PyObject *tbList, *emptyString, *strRetval;
+    /* added recipients */
+    rcpt_count = expy_get_count(r, 4);
+    added_rcpt = malloc((rcpt_count ? rcpt_count : 1) * sizeof(uschar *));
+    if (!added_rcpt)
+        r->ok = FALSE;
 
-        tbList = PyObject_CallMethod(
-            tracebackModule,
-            "format_exception",
-            "OOO",
-            type,
-            value == NULL ? Py_None : value,
-            traceback == NULL ? Py_None : traceback);
+    for (i = 0; r->ok && (i < rcpt_count); i++)
+        {
+        added_rcpt[i] = expy_get_string(r);
+        if (!added_rcpt[i])
+            r->ok = FALSE;
+        }
 
-        emptyString = PyString_FromString("");
-        strRetval = PyObject_CallMethod(emptyString, "join",
-            "O", tbList);
+    hlines = malloc((hcount ? hcount : 1) * sizeof(header_line *));
+    if (!hlines)
+        r->ok = FALSE;
 
-        chrRetval = strdup(PyString_AsString(strRetval));
+    /* all there and making sense, so now change the message */
+    if (r->ok)
+        {
+        *rc = verdict;
+        if (text)
+            *return_text = text;
 
-        Py_DECREF(tbList);
-        Py_DECREF(emptyString);
-        Py_DECREF(strRetval);
-        Py_DECREF(tracebackModule);
+        for (i = 0, h = header_list; h; h = h->next)
+            hlines[i++] = h;
+
+        for (i = 0; i < type_count; i++)
+            hlines[type_index[i]]->type = type_value[i];
+
+        for (i = 0; i < header_count; i++)
+            {
+            header_add(' ', get_format_string((char *)added_text[i], 1));
+            header_last->type = added_type[i];
+            }
+
+        for (i = j = k = 0; i < recipients_count; i++)
+            {
+            if ((k < removed_count) && (removed[k] == i))
+                k++;
+            else
+                recipients_list[j++] = recipients_list[i];
+            }
+        recipients_count = j;
+
+        for (i = 0; i < rcpt_count; i++)
+            receive_add_recipient(added_rcpt[i], -1);
+        }
+
+    free(hlines);
+    free(added_rcpt);
+    free(removed);
+    free(added_text);
+    free(added_type);
+    free(type_value);
+    free(type_index);
+
+    return r->ok;
     }
-    else
+
+
+static int expy_daemon_scan(int fd, uschar **return_text, int python_failure_return)
     {
-        chrRetval = strdup("Unable to import traceback module.");
-    }
+    expy_buffer_t b;
+    expy_reader_t r;
+    struct timeval start;
+    int sock;
+    int type;
+    int rc = python_failure_return;
+    int fork_usec = -1;
+    BOOL done = FALSE;
+
+    gettimeofday(&start, NULL);
+
+    sock = expy_daemon_connect(fd);
+    if (sock < 0)
+        {
+        *return_text = (uschar *)"Internal error";
+        log_write(0, LOG_PANIC, "expy: couldn't pass message to scan daemon at %s: %s", expy_scan_socket, strerror(errno));
+        return python_failure_return;
+        }
 
-    Py_DECREF(type);
-    Py_XDECREF(value);
-    Py_XDECREF(traceback);
+    memset(&b, 0, sizeof(b));
+    expy_daemon_request(&b);
+
+    if (!expy_send_frame(sock, expy_forkserver ? 'F' : 'R', &b))
+        {
+        free(b.data);
+        close(sock);
+        *return_text = (uschar *)"Internal error";
+        log_write(0, LOG_PANIC, "expy: couldn't pass message to scan daemon at %s: %s", expy_scan_socket, strerror(errno));
+        return python_failure_return;
+        }
+
+    while (!done && expy_recv_frame(sock, &type, &r))
+        {
+        uschar *s;
+        int which;
+
+        switch (type)
+            {
+            case 'X':
+                /* Just one string, with no NULs in it */
+                s = expy_get_string(&r);
+                b.len = 0;
+                if (!s || (r.len != 4 + Ustrlen(s)))
+                    {
+                    expy_put(&b, "0", 1);
+                    expy_put_string(&b, US"malformed expansion request");
+                    }
+                else if ((s = expand_string(s)))
+                    {
+                    expy_put(&b, "1", 1);
+                    expy_put_string(&b, s);
+                    }
+                else
+                    {
+                    expy_put(&b, "0", 1);
+                    expy_put_string(&b, expand_string_message ? expand_string_message : US"expansion failed");
+                    }
+                if (!expy_send_frame(sock, 'x', &b))
+                    {
+                    log_write(0, LOG_PANIC, "expy: couldn't answer scan daemon at %s: %s", expy_scan_socket, strerror(errno));
+                    *return_text = (uschar *)"Internal error";
+                    done = TRUE;
+                    }
+                break;
+
+            case 'L':
+                which = expy_get_int(&r);
+                s = expy_get_string(&r);
+                if (s)
+                    log_write(0, which, "%s", get_format_string((char *)s, 0));
+                break;
+
+            case 'D':
+                s = expy_get_string(&r);
+                if (s)
+                    debug_printf("%s", get_format_string((char *)s, 0));
+                break;
+
+            case 'T':
+                fork_usec = expy_get_int(&r);
+                break;
+
+            case 'E':
+                s = expy_get_string(&r);
+                log_write(0, LOG_PANIC, "local_scan function failed");
+                log_write(0, LOG_PANIC, "%s", s ? s : US"(no traceback)");
+                *return_text = (uschar *)"Internal error";
+                done = TRUE;
+                break;
+
+            case 'V':
+                if (!expy_daemon_verdict(&r, &rc, return_text))
+                    {
+                    log_write(0, LOG_PANIC, "expy: malformed verdict from scan daemon at %s", expy_scan_socket);
+                    *return_text = (uschar *)"Internal error";
+                    rc = python_failure_return;
+                    }
+                done = TRUE;
+                break;
+
+            default:
+                log_write(0, LOG_PANIC, "expy: unexpected frame type 0x%02x from scan daemon at %s", type, expy_scan_socket);
+                *return_text = (uschar *)"Internal error";
+                done = TRUE;
+                break;
+            }
+
+        free(r.data);
+        }
+
+    if (!done)
+        {
+        log_write(0, LOG_PANIC, "expy: lost connection to scan daemon at %s: %s", expy_scan_socket,
+            errno ? strerror(errno) : "connection closed");
+        *return_text = (uschar *)"Internal error";
+        }
+
+    free(b.data);
+    close(sock);
+
+    if (expy_log_timing)
+        {
+        if (fork_usec >= 0)
+            log_write(0, LOG_MAIN, "expy: forkserver scan took %ldus (fork %dus)", expy_usec_since(&start), fork_usec);
+        else
+            log_write(0, LOG_MAIN, "expy: daemon scan took %ldus", expy_usec_since(&start));
+        }
+
+    return rc;
+    }
 
-    return chrRetval;
-}
 
+/* ----------- Actual local_scan function ------------ */
 
 int local_scan(int fd, uschar **return_text)
     {
     int python_failure_return = LOCAL_SCAN_TEMPREJECT;
-    PyObject *user_dict;
-    PyObject *user_func;
+    PyObject *args;
     PyObject *result;
     PyObject *exim_headers;
+    PyObject *exim_recipients;
     PyObject *original_recipients;
     PyObject *working_recipients;
+    struct timeval start;
 
     if (!expy_enabled)
         return LOCAL_SCAN_ACCEPT;
@@ -650,148 +5267,92 @@ int local_scan(int fd, uschar **return_text)
     else if (strcmpic(expy_scan_failure, US"deny") == 0)
         python_failure_return = LOCAL_SCAN_REJECT;
 
-    if (!Py_IsInitialized())  /* local_scan() may have already been run */
-        {
-        /* It is definitely cleanest to set a program name here. 
-        However, it's not really clear *what* name to use. In many ways,
-        Exim would be most accurate, but that will not necessarily be the
-        starting location for finding libraries that is wanted.
-        Hard-coding /usr/local/ here is SE specific, and something more
-        generic would need to be used to submit this upstream. */
-        Py_SetProgramName("/usr/local/bin/python");
-        Py_Initialize();
-        ExPy_Header_Line.ob_type = &PyType_Type;
-        }
-
-    if (!expy_exim_dict)
+    if (!expy_options_checked)
         {
-        PyObject *module = Py_InitModule((const char *)expy_exim_module, expy_exim_methods); /* Borrowed reference */
-        Py_INCREF(module);                                 /* convert to New reference */
-        expy_exim_dict = PyModule_GetDict(module);         /* Borrowed reference */
-        Py_INCREF(expy_exim_dict);                         /* convert to New reference */
+        if (expy_forkserver && !expy_scan_socket)
+            log_write(0, LOG_PANIC, "expy: expy_forkserver is set without expy_scan_socket, and has no effect");
+#ifndef __GLIBC__
+        if (expy_preload)
+            log_write(0, LOG_PANIC, "expy: expy_preload needs Exim built with glibc, and has no effect");
+#endif
+        expy_options_checked = TRUE;
         }
 
-    if (!expy_user_module)
-        {
-        if (expy_path_add)
-            {
-            PyObject *sys_module;
-            PyObject *sys_dict;
-            PyObject *sys_path;
-            PyObject *add_value;
-
-            sys_module = PyImport_ImportModule("sys");  /* New Reference */
-            if (!sys_module)
-                {
-                *return_text = (uschar *)"Internal error";
-                log_write(0, LOG_PANIC, "Couldn't import Python 'sys' module");
-                log_write(0, LOG_PANIC, "%s", getPythonTraceback());
-                return python_failure_return;
-                }
-
-            sys_dict = PyModule_GetDict(sys_module);               /* Borrowed Reference, never fails */
-            sys_path = PyMapping_GetItemString(sys_dict, "path");  /* New reference */
+    if (expy_scan_socket)
+        return expy_daemon_scan(fd, return_text, python_failure_return);
 
-            if (!sys_path || (!PyList_Check(sys_path)))
-                {
-                *return_text = (uschar *)"Internal error";
-                log_write(0, LOG_PANIC, "expy: Python sys.path doesn't exist or isn't a list");
-                log_write(0, LOG_PANIC, "%s", getPythonTraceback());
-                return python_failure_return;
-                }
+    expy_init_python();
 
-            add_value = PyString_FromString((const char *)expy_path_add);  /* New reference */
-            if (!add_value)
-                {
-                PyErr_Clear();
-                log_write(0, LOG_PANIC, "expy: Failed to create Python string from [%s]", expy_path_add);
-                return python_failure_return;
-                }
+    if (!expy_user_module && !expy_import_user_module())
+        {
+        *return_text = (uschar *)"Internal error";
+        return python_failure_return;
+        }
 
-            if (PyList_Append(sys_path, add_value))
-                {
-                PyErr_Clear();
-                log_write(0, LOG_PANIC, "expy: Failed to append [%s] to Python sys.path", expy_path_add);
-                }
+    expy_check_reload();
 
-            Py_DECREF(add_value);
-            Py_DECREF(sys_path);
-            Py_DECREF(sys_module);
-            }
+    if (!expy_user_func)
+        {
+        *return_text = (uschar *)"Internal error";
+        log_write(0, LOG_PANIC, "Python %s module doesn't have a %s function", expy_scan_module, expy_scan_function);
+        return python_failure_return;
+        }
 
-        expy_user_module = PyImport_ImportModule((const char *)expy_scan_module);  /* New Reference */
+    /* so far so good, prepare to run function */
 
-        if (!expy_user_module)
+    /* Copy exim variables, unless they're going to be in a message object */
+    if (expy_scan_context)
+        {
+        args = expy_message_begin(fd);
+        if (!args)
             {
-            PyErr_Clear();
             *return_text = (uschar *)"Internal error";
-            log_write(0, LOG_PANIC, "Couldn't import Python '%s' module", expy_scan_module);
+            log_write(0, LOG_PANIC, "expy: couldn't create message object");
+            log_write(0, LOG_PANIC, "%s", getPythonTraceback());
             return python_failure_return;
             }
         }
+    else
+        {
+        expy_refresh_message_vars(fd);
+        args = expy_empty_tuple;
+        }
 
-    user_dict = PyModule_GetDict(expy_user_module);                      /* Borrowed Reference, never fails */
-    user_func = PyMapping_GetItemString(user_dict, (char *)expy_scan_function);  /* New reference */
+    expy_expansions_changed();
 
-    if (!user_func)
+    /* set the headers */
+    exim_headers = expy_headers_begin();     /* Borrowed reference */
+    if (!exim_headers)
         {
-        PyErr_Clear();
         *return_text = (uschar *)"Internal error";
-        log_write(0, LOG_PANIC, "Python %s module doesn't have a %s function", expy_scan_module, expy_scan_function);
+        log_write(0, LOG_PANIC, "expy: couldn't create headers object");
+        log_write(0, LOG_PANIC, "%s", getPythonTraceback());
+        expy_message_end();
         return python_failure_return;
         }
-
-    /* so far so good, prepare to run function */
-
-    /* Copy exim variables */
-    expy_dict_int("debug_selector", debug_selector);
-    expy_dict_int("host_checking", host_checking);
-    expy_dict_string("interface_address", interface_address);
-    expy_dict_int("interface_port", interface_port);
-    expy_dict_string("message_id", message_id);
-    expy_dict_string("received_protocol", received_protocol);
-    expy_dict_string("sender_address", sender_address);
-    expy_dict_string("sender_host_address", sender_host_address);
-    expy_dict_string("sender_host_authenticated", sender_host_authenticated);
-    expy_dict_string("sender_host_name", sender_host_name);
-    expy_dict_int("sender_host_port", sender_host_port);
-    expy_dict_int("fd", fd);
-
-    /* copy some constants */
-    expy_dict_int("LOG_MAIN", LOG_MAIN);
-    expy_dict_int("LOG_PANIC", LOG_PANIC);
-    expy_dict_int("LOG_REJECT", LOG_REJECT);
-
-    expy_dict_int("LOCAL_SCAN_ACCEPT", LOCAL_SCAN_ACCEPT);
-    expy_dict_int("LOCAL_SCAN_ACCEPT_FREEZE", LOCAL_SCAN_ACCEPT_FREEZE);
-    expy_dict_int("LOCAL_SCAN_ACCEPT_QUEUE", LOCAL_SCAN_ACCEPT_QUEUE);
-    expy_dict_int("LOCAL_SCAN_REJECT", LOCAL_SCAN_REJECT);
-    expy_dict_int("LOCAL_SCAN_REJECT_NOLOGHDR", LOCAL_SCAN_REJECT_NOLOGHDR);
-    expy_dict_int("LOCAL_SCAN_TEMPREJECT", LOCAL_SCAN_TEMPREJECT);
-    expy_dict_int("LOCAL_SCAN_TEMPREJECT_NOLOGHDR", LOCAL_SCAN_TEMPREJECT_NOLOGHDR);
-    expy_dict_int("MESSAGE_ID_LENGTH", MESSAGE_ID_LENGTH);
-    expy_dict_int("SPOOL_DATA_START_OFFSET", SPOOL_DATA_START_OFFSET);
-
-    expy_dict_int("D_v", D_v);
-    expy_dict_int("D_local_scan", D_local_scan);
-
-    /* set the headers */
-    exim_headers = get_headers();
     PyDict_SetItemString(expy_exim_dict, "headers", exim_headers);
+    Py_CLEAR(expy_header_index);
 
-    /*
-     * make list of recipients, give module a copy to work with in
-     * List format, but keep original tuple to compare against later
-     */
-    original_recipients = get_recipients();                     /* New reference */
-    working_recipients = PySequence_List(original_recipients);  /* New reference */
-    PyDict_SetItemString(expy_exim_dict, "recipients", working_recipients);
-    Py_DECREF(working_recipients);
+    /* and the recipients, which keep track of changes made to them */
+    exim_recipients = expy_recipients_begin();  /* Borrowed reference */
+    if (!exim_recipients)
+        {
+        *return_text = (uschar *)"Internal error";
+        log_write(0, LOG_PANIC, "expy: couldn't create recipients object");
+        log_write(0, LOG_PANIC, "%s", getPythonTraceback());
+        expy_message_end();
+        expy_headers_end();
+        return python_failure_return;
+        }
+    PyDict_SetItemString(expy_exim_dict, "recipients", exim_recipients);
 
     /* Try calling our function */
-    result = PyObject_CallFunction(user_func, NULL);            /* New reference */
+    gettimeofday(&start, NULL);
+    result = PyObject_Call(expy_user_func, args, NULL);        /* New reference */
+    expy_message_end();
 
-    Py_DECREF(user_func);  /* Don't need ref to function anymore */
+    if (expy_log_timing)
+        log_write(0, LOG_MAIN, "expy: in-process scan took %ldus", expy_usec_since(&start));
 
     /* Check for Python exception */
     if (!result)
@@ -799,51 +5360,56 @@ int local_scan(int fd, uschar **return_text)
         *return_text = (uschar *)"Internal error";
         log_write(0, LOG_PANIC, "local_scan function failed");
         log_write(0, LOG_PANIC, "%s", getPythonTraceback());
-        Py_DECREF(original_recipients);
-        clear_headers(exim_headers);
-        Py_DECREF(exim_headers);
+        expy_recipients_rollback();
+        expy_recipients_end();
+        expy_headers_end();
         return python_failure_return;
         }
 
     /* User code may have replaced recipient list, so re-get ref */
     working_recipients = PyDict_GetItemString(expy_exim_dict, "recipients"); /* Borrowed reference */
-    Py_XINCREF(working_recipients);                                           /* convert to New reference */
 
-    /*
-     * reconcile original recipient list with what's present after
-     * Python code is done
-     */
-    if ((!working_recipients) || (!PySequence_Check(working_recipients)) || (PySequence_Size(working_recipients) == 0))
-        /* Python code either deleted exim.recipients altogether, or replaced
-           it with a non-list, or emptied out the list */
-        recipients_count = 0;
+    if (working_recipients == exim_recipients)
+        expy_recipients_commit();
     else
         {
-        Py_ssize_t i;
+        /*
+         * Something else in its place, so forget what was done through
+         * the recipients object, and reconcile the original recipient
+         * list with what's present after Python code is done
+         */
+        expy_recipients_rollback();
 
-        /* remove original recipients not on the working list, reverse order important! */
-        for (i = recipients_count - 1; i >= 0; i--)
-            {
-            PyObject *addr = PyTuple_GET_ITEM(original_recipients, i); /* borrowed ref */
-            if (!PySequence_Contains(working_recipients, addr))
-                expy_remove_recipient(i);
-            }
+        Py_XINCREF(working_recipients);                                 /* convert to New reference */
+        original_recipients = get_recipients();                         /* New reference */
 
-        /* add new recipients not in the original list */
-        for (i = PySequence_Size(working_recipients) - 1; i >= 0; i--)
+        if ((!working_recipients) || (!PySequence_Check(working_recipients)) || (PySequence_Size(working_recipients) == 0))
+            /* Python code either deleted exim.recipients altogether, or replaced
+               it with a non-list, or emptied out the list */
+            recipients_count = 0;
+        else if (!expy_reconcile_recipients(original_recipients, working_recipients))
             {
-            PyObject *addr = PySequence_GetItem(working_recipients, i);
-            if (!PySequence_Contains(original_recipients, addr))
-                receive_add_recipient((uschar *)PyString_AsString(addr), -1);
-            Py_DECREF(addr);
+            *return_text = (uschar *)"Internal error";
+            log_write(0, LOG_PANIC, "Python %s.%s function left unusable recipients", expy_scan_module, expy_scan_function);
+            log_write(0, LOG_PANIC, "%s", getPythonTraceback());
+            Py_DECREF(working_recipients);
+            Py_DECREF(original_recipients);
+            Py_DECREF(result);
+            expy_recipients_end();
+            expy_headers_end();
+            return python_failure_return;
             }
+
+        Py_XDECREF(working_recipients);   /* No longer needed */
+        Py_DECREF(original_recipients);   /* No longer needed */
         }
 
-    Py_XDECREF(working_recipients);   /* No longer needed */
-    Py_DECREF(original_recipients);   /* No longer needed */
+    expy_recipients_end();
+
+    if (expy_memory_report && (expy_memory_reported != getpid()))
+        expy_log_memory("after first scan");
 
-    clear_headers(exim_headers);
-    Py_DECREF(exim_headers);          /* No longer needed */
+    expy_headers_end();
 
     /* Deal with the return value, first see if python returned a non-empty sequence */
     if (PySequence_Check(result) && (PySequence_Size(result) > 0))
@@ -0,0 +1,829 @@
+#!/usr/bin/env python
+"""
+Out-of-process scanner for the Exim Python local_scan.
+
+When expy_scan_socket is set in the Exim configure file, Exim doesn't
+run Python itself.  It connects to the Unix socket this program
+listens on, passes over the message's spool file descriptor along
+with its headers, recipients and other variables, and applies
+whatever verdict, header changes and recipient changes come back.
+
+A fixed pool of worker processes, each with the local_scan module
+already imported, takes turns handling those connections, so the
+pool can be sized to the number of CPUs rather than the number of
+SMTP connections Exim happens to have open.
+
+If Exim has expy_forkserver set, a worker doesn't run the scan itself
+but forks a child process to do it, so anything the scan leaks or
+breaks goes away with the child.
+
+Your local_scan module runs unchanged: this program provides an
+'exim' module that looks like the one built into Exim, except that
+child_open(), child_close() and child_open_exim() aren't available.
+expand(), expand_many() and var() work, but each new expansion is
+a round trip back to Exim.
+
+"""
+import gc
+import os
+import signal
+import socket
+import struct
+import sys
+import time
+import traceback
+import types
+from email.header import decode_header as email_decode_header, make_header
+from optparse import OptionParser
+
+
+PROTOCOL_VERSION = b'1'
+
+#
+# Names of the values sent with every request, in wire order
+#
+CONSTANTS = (
+    'LOG_MAIN', 'LOG_PANIC', 'LOG_REJECT',
+    'LOCAL_SCAN_ACCEPT', 'LOCAL_SCAN_ACCEPT_FREEZE', 'LOCAL_SCAN_ACCEPT_QUEUE',
+    'LOCAL_SCAN_REJECT', 'LOCAL_SCAN_REJECT_NOLOGHDR',
+    'LOCAL_SCAN_TEMPREJECT', 'LOCAL_SCAN_TEMPREJECT_NOLOGHDR',
+    'MESSAGE_ID_LENGTH', 'SPOOL_DATA_START_OFFSET', 'D_v', 'D_local_scan',
+    )
+
+INT_VARIABLES = ('debug_selector', 'host_checking', 'interface_port', 'sender_host_port')
+
+STRING_VARIABLES = (
+    'interface_address', 'message_id', 'received_protocol', 'sender_address',
+    'sender_host_address', 'sender_host_authenticated', 'sender_host_name',
+    )
+
+NONE_LENGTH = 0xffffffff
+
+
+class ProtocolError(Exception):
+    pass
+
+
+# ---------- Encoding and decoding ------------
+
+if sys.version_info[0] < 3:
+    INTEGER_TYPES = (int, long)
+
+    def to_text(b):
+        return b
+
+    def to_bytes(s):
+        return s
+else:
+    INTEGER_TYPES = (int,)
+
+    def to_text(b):
+        return b.decode('utf-8', 'surrogateescape')
+
+    def to_bytes(s):
+        return str(s).encode('utf-8', 'surrogateescape')
+
+
+class Writer(object):
+    def __init__(self):
+        self.parts = []
+
+    def byte(self, ch):
+        self.parts.append(ch)
+
+    def int(self, i):
+        self.parts.append(struct.pack('>i', i))
+
+    def uint(self, i):
+        self.parts.append(struct.pack('>I', i))
+
+    def string(self, s):
+        if s is None:
+            self.uint(NONE_LENGTH)
+        else:
+            s = to_bytes(s)
+            self.uint(len(s))
+            self.parts.append(s)
+
+    def getvalue(self):
+        return b''.join(self.parts)
+
+
+class Reader(object):
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def _take(self, n):
+        if self.pos + n > len(self.data):
+            raise ProtocolError('truncated frame')
+        result = self.data[self.pos:self.pos+n]
+        self.pos += n
+        return result
+
+    def byte(self):
+        return self._take(1)
+
+    def int(self):
+        return struct.unpack('>i', self._take(4))[0]
+
+    def uint(self):
+        return struct.unpack('>I', self._take(4))[0]
+
+    def string(self):
+        n = self.uint()
+        if n == NONE_LENGTH:
+            return None
+        return to_text(self._take(n))
+
+
+def recv_exactly(sock, n):
+    result = []
+    while n:
+        data = sock.recv(n)
+        if not data:
+            raise ProtocolError('connection closed')
+        result.append(data)
+        n -= len(data)
+    return b''.join(result)
+
+
+def send_frame(sock, frame_type, payload=b''):
+    sock.sendall(struct.pack('>cI', frame_type, len(payload)) + payload)
+
+
+def recv_frame(sock):
+    frame_type, length = struct.unpack('>cI', recv_exactly(sock, 5))
+    return frame_type, Reader(recv_exactly(sock, length))
+
+
+def recv_fd(sock):
+    """
+    Receive the single byte and file descriptor Exim sends first
+    """
+    if hasattr(sock, 'recvmsg'):
+        size = struct.calcsize('i')
+        data, ancdata, flags, addr = sock.recvmsg(1, socket.CMSG_SPACE(size))
+        for level, kind, cdata in ancdata:
+            if (level == socket.SOL_SOCKET) and (kind == socket.SCM_RIGHTS):
+                fd = struct.unpack('i', cdata[:size])[0]
+                break
+        else:
+            raise ProtocolError('no file descriptor received')
+    else:
+        import _multiprocessing
+        data = PROTOCOL_VERSION
+        fd = _multiprocessing.recvfd(sock.fileno())
+
+    if data != PROTOCOL_VERSION:
+        os.close(fd)
+        raise ProtocolError('unsupported protocol version %r' % data)
+    return fd
+
+
+def send_fd(sock, fd):
+    if hasattr(sock, 'sendmsg'):
+        sock.sendmsg([PROTOCOL_VERSION], [(socket.SOL_SOCKET, socket.SCM_RIGHTS, struct.pack('i', fd))])
+    else:
+        import _multiprocessing
+        _multiprocessing.sendfd(sock.fileno(), fd)
+
+
+# ---------- The stand-in exim module ------------
+
+class ExpansionError(ValueError):
+    pass
+
+
+#
+# Counters for exim.stats(), for the life of the worker
+#
+STATS = {'expand_cache_hits': 0, 'expand_cache_misses': 0}
+
+def stats():
+    return dict(STATS)
+
+
+def decode_header(s):
+    """
+    Decode RFC 2047 encoded-words, into UTF-8 rather than
+    whatever Exim's headers_charset is
+    """
+    try:
+        decoded = make_header(email_decode_header(s))
+    except Exception:
+        raise ValueError('decoding [%s] failed: %s' % (s, sys.exc_info()[1]))
+    if str is bytes:
+        return unicode(decoded).encode('utf-8')
+    return str(decoded)
+
+
+class HeaderLine(object):
+    """
+    Like the header objects in the embedded version, .text, .name,
+    .value and .decoded are read-only and .type may be set to a
+    single character.
+    """
+    __slots__ = ('_text', '_type', '_name', '_value', '_decoded', 'original_type')
+
+    def __init__(self, text, type):
+        self._text = text
+        self._type = type
+        self._name = None
+        self._decoded = None
+
+    def _get_text(self):
+        return self._text
+
+    def _split(self):
+        name, colon, value = self._text.partition(':')
+        if not colon:
+            name, value = '', name
+        self._name = name.rstrip().lower()
+        self._value = value.strip()
+
+    def _get_name(self):
+        if self._name is None:
+            self._split()
+        return self._name
+
+    def _get_value(self):
+        if self._name is None:
+            self._split()
+        return self._value
+
+    def _get_decoded(self):
+        if self._decoded is None:
+            try:
+                self._decoded = decode_header(self._get_value())
+            except ValueError:
+                self._decoded = self._get_value()
+        return self._decoded
+
+    def _get_type(self):
+        return self._type
+
+    def _set_type(self, value):
+        if (not isinstance(value, str)) or (len(value) != 1):
+            raise TypeError('header.type can only be set to a single-character value')
+        self._type = value
+
+    text = property(_get_text)
+    name = property(_get_name)
+    value = property(_get_value)
+    decoded = property(_get_decoded)
+    type = property(_get_type, _set_type)
+
+
+def split_address(address):
+    """
+    (local part, domain), split at the last '@'
+    """
+    local_part, at, domain = address.rpartition('@')
+    if not at:
+        return address, ''
+    return local_part, domain
+
+
+def _domain(address):
+    at = address.rfind('@')
+    if at < 0:
+        return None
+    return address[at + 1:]
+
+
+def _strings(iterable):
+    if isinstance(iterable, (bytes, type(u''))):
+        raise TypeError('expected an iterable of strings, not a string')
+    return list(iterable)
+
+
+class Recipients(list):
+    """
+    A list with the bulk methods of the embedded version's recipients object
+    """
+    def add_many(self, iterable):
+        items = _strings(iterable)
+        for a in items:
+            if not isinstance(a, (bytes, type(u''))):
+                raise TypeError('recipients can only be strings')
+        self.extend(items)
+        return len(items)
+
+    def _remove_where(self, unwanted):
+        kept = [a for a in self if not unwanted(a)]
+        removed = len(self) - len(kept)
+        self[:] = kept
+        return removed
+
+    def remove_many(self, iterable):
+        addresses = set(_strings(iterable))
+        return self._remove_where(lambda a: a in addresses)
+
+    def remove_where_domain_in(self, iterable):
+        domains = set(d.lower() for d in _strings(iterable))
+        def unwanted(a):
+            domain = _domain(a)
+            return (domain is not None) and (domain.lower() in domains)
+        return self._remove_where(unwanted)
+
+    def partition_by_domain(self):
+        result = {}
+        for a in self:
+            result.setdefault((_domain(a) or '').lower(), []).append(a)
+        return result
+
+
+class Scan(object):
+    """
+    State of the message being scanned through one connection
+    """
+    def __init__(self, sock, module, expand_cache=False):
+        self.sock = sock
+        self.module = module
+        self.expand_cache = expand_cache
+        self.added_headers = []
+        self.var_cache = {}
+        self.expand_memo = {}
+        self.header_index = None
+
+    def expand(self, s):
+        if self.expand_cache:
+            result = self.expand_memoized(s)
+            if isinstance(result, ExpansionError):
+                raise result
+            return result
+        return self.expand_uncached(s)
+
+    def expand_uncached(self, s):
+        w = Writer()
+        w.string(s)
+        send_frame(self.sock, b'X', w.getvalue())
+        frame_type, r = recv_frame(self.sock)
+        if frame_type != b'x':
+            raise ProtocolError('unexpected frame %r' % frame_type)
+        ok = r.byte()
+        result = r.string()
+        if ok != b'1':
+            raise ExpansionError('expansion [%s] failed: %s' % (s, result))
+        return result
+
+    def expand_memoized(self, s):
+        """
+        Expand a string or, with the cache on, find it already
+        done, returning an ExpansionError rather than raising it
+        """
+        if not self.expand_cache:
+            try:
+                return self.expand_uncached(s)
+            except ExpansionError:
+                return sys.exc_info()[1]
+        try:
+            value = self.expand_memo[s]
+            STATS['expand_cache_hits'] += 1
+        except KeyError:
+            STATS['expand_cache_misses'] += 1
+            try:
+                value = self.expand_uncached(s)
+            except ExpansionError:
+                value = sys.exc_info()[1]
+            self.expand_memo[s] = value
+        return value
+
+    def expand_many(self, strings):
+        if isinstance(strings, dict):
+            items = strings.items()
+        else:
+            items = ((s, s) for s in strings)
+
+        result = {}
+        for key, s in items:
+            result[key] = self.expand_memoized(s)
+        return result
+
+    def var(self, name):
+        try:
+            return self.var_cache[name]
+        except KeyError:
+            pass
+        if (not name) or (len(name) > 128) or (not name.replace('_', '').isalnum()):
+            raise ValueError('invalid variable name [%s]' % name)
+        result = self.var_cache[name] = self.expand_uncached('$' + name)
+        return result
+
+    def _find_headers(self, name):
+        if self.header_index is None:
+            self.header_index = {}
+            for h in self.module.headers:
+                if isinstance(h, HeaderLine):
+                    self.header_index.setdefault(h.name, []).append(h)
+        return self.header_index.get(name.lower(), ())
+
+    def get_header(self, name):
+        for h in self._find_headers(name):
+            if h.type != '*':
+                return h
+        return None
+
+    def get_headers(self, name):
+        return [h for h in self._find_headers(name) if h.type != '*']
+
+    def log(self, s, which=None):
+        if which is None:
+            which = self.module.LOG_MAIN
+        w = Writer()
+        w.int(which)
+        w.string(s)
+        send_frame(self.sock, b'L', w.getvalue())
+
+    def debug_print(self, s):
+        if self.module.debug_selector:
+            w = Writer()
+            w.string(s)
+            send_frame(self.sock, b'D', w.getvalue())
+
+    def add_header(self, s):
+        if not s.endswith('\n'):
+            s += '\n'
+        h = HeaderLine(s, ' ')
+        self.var_cache.clear()
+        self.expand_memo.clear()
+        self.added_headers.append(h)
+        self.module.headers.append(h)
+        if self.header_index is not None:
+            self.header_index.setdefault(h.name, []).append(h)
+
+
+def not_available(*args):
+    raise NotImplementedError('not available in expy_scan_daemon')
+
+
+def make_exim_module(name):
+    module = types.ModuleType(name)
+    module.ExpansionError = ExpansionError
+    module.stats = stats
+    module.decode_header = decode_header
+    module.split_address = split_address
+    module.child_open = not_available
+    module.child_close = not_available
+    module.child_open_exim = not_available
+    sys.modules[name] = module
+    return module
+
+
+# ---------- Handling one scan request ------------
+
+def read_request(r, module):
+    for name in CONSTANTS:
+        setattr(module, name, r.int())
+    for name in INT_VARIABLES:
+        setattr(module, name, r.int())
+    for name in STRING_VARIABLES:
+        setattr(module, name, r.string())
+
+    headers = []
+    for i in range(r.uint()):
+        htype = to_text(r.byte())
+        headers.append(HeaderLine(r.string(), htype))
+
+    recipients = []
+    for i in range(r.uint()):
+        recipients.append(r.string())
+
+    return headers, recipients
+
+
+def write_verdict(rc, return_text, headers, scan, recipients, working):
+    w = Writer()
+    w.int(rc)
+    w.string(return_text)
+
+    changed = [(i, h.type) for i, h in enumerate(headers) if h.type != h.original_type]
+    w.uint(len(changed))
+    for i, htype in changed:
+        w.uint(i)
+        w.byte(to_bytes(htype))
+
+    w.uint(len(scan.added_headers))
+    for h in scan.added_headers:
+        w.byte(to_bytes(h.type))
+        w.string(h.text)
+
+    #
+    # Same reconciliation as the embedded version: an empty or missing
+    # list drops everyone, otherwise remove what's gone and add what's new
+    #
+    if (working is None) or (not hasattr(working, '__len__')) or (len(working) == 0):
+        removed = list(range(len(recipients)))
+        added = []
+    else:
+        working_set = set(working)
+        original_set = set(recipients)
+        removed = [i for i, addr in enumerate(recipients) if addr not in working_set]
+        added = [addr for addr in working if addr not in original_set]
+
+    w.uint(len(removed))
+    for i in removed:
+        w.uint(i)
+    w.uint(len(added))
+    for addr in added:
+        w.string(addr)
+
+    return w.getvalue()
+
+
+def scan_request(sock, fd, r, options, module, user_module):
+    headers, recipients = read_request(r, module)
+    for h in headers:
+        h.original_type = h.type
+
+    scan = Scan(sock, module, options.expand_cache)
+    module.fd = fd
+    module.headers = list(headers)
+    module.recipients = Recipients(recipients)
+    module.expand = scan.expand
+    module.expand_many = scan.expand_many
+    module.var = scan.var
+    module.get_header = scan.get_header
+    module.get_headers = scan.get_headers
+    module.log = scan.log
+    module.debug_print = scan.debug_print
+    module.add_header = scan.add_header
+
+    try:
+        func = getattr(user_module, options.function)
+        result = func()
+
+        return_text = None
+        if isinstance(result, (tuple, list)) and result:
+            if len(result) > 1:
+                return_text = str(result[1])
+            result = result[0]
+        if (not isinstance(result, INTEGER_TYPES)) or isinstance(result, bool):
+            raise TypeError('Python %s.%s function didn\'t return integer' % (options.module, options.function))
+        if not (-2**31 <= result < 2**31):
+            raise ValueError('Python %s.%s function returned %d, out of range' % (options.module, options.function, result))
+    except Exception:
+        w = Writer()
+        w.string(''.join(traceback.format_exception(*sys.exc_info())))
+        send_frame(sock, b'E', w.getvalue())
+        return
+
+    payload = write_verdict(result, return_text, headers, scan, recipients, getattr(module, 'recipients', None))
+    send_frame(sock, b'V', payload)
+
+
+def fork_scan(sock, fd, r, options, module, user_module):
+    """
+    Scan in a child process of this one, so whatever the scan
+    does to the interpreter dies with the child.  The child
+    starts by telling Exim how long the fork took.
+    """
+    start = time.time()
+    pid = os.fork()
+    if pid:
+        pid, status = os.waitpid(pid, 0)
+        if status:
+            sys.stderr.write('scan process %d exited with status 0x%04x\n' % (pid, status))
+        return
+
+    try:
+        w = Writer()
+        w.uint(int((time.time() - start) * 1000000))
+        send_frame(sock, b'T', w.getvalue())
+
+        if options.scan_timeout:
+            signal.alarm(options.scan_timeout)
+
+        scan_request(sock, fd, r, options, module, user_module)
+    except Exception:
+        traceback.print_exc()
+        os._exit(1)
+    os._exit(0)
+
+
+def handle(sock, options, module, user_module):
+    fd = recv_fd(sock)
+    try:
+        frame_type, r = recv_frame(sock)
+        if frame_type == b'R':
+            scan_request(sock, fd, r, options, module, user_module)
+        elif frame_type == b'F':
+            fork_scan(sock, fd, r, options, module, user_module)
+        else:
+            raise ProtocolError('unexpected frame %r' % frame_type)
+    finally:
+        os.close(fd)
+
+
+def worker(listener, options):
+    module = make_exim_module(options.exim_module)
+    user_module = __import__(options.module)
+    for name in options.module.split('.')[1:]:
+        user_module = getattr(user_module, name)
+
+    #
+    # Keep what's been loaded so far out of the way of the garbage
+    # collector, so the pages holding it stay shared with any
+    # forked scanning processes
+    #
+    gc.collect()
+    if hasattr(gc, 'freeze'):
+        gc.freeze()
+
+    count = 0
+    while True:
+        sock, addr = listener.accept()
+        try:
+            handle(sock, options, module, user_module)
+        except Exception:
+            traceback.print_exc()
+        sock.close()
+
+        count += 1
+        if options.max_requests and (count >= options.max_requests):
+            return
+
+
+def spawn(listener, options):
+    pid = os.fork()
+    if pid:
+        return pid
+
+    signal.signal(signal.SIGTERM, signal.SIG_DFL)
+    try:
+        worker(listener, options)
+    except KeyboardInterrupt:
+        pass
+    except Exception:
+        traceback.print_exc()
+        os._exit(1)
+    os._exit(0)
+
+
+def serve(options, socket_path):
+    for p in options.path:
+        sys.path.append(p)
+
+    if os.path.exists(socket_path):
+        os.unlink(socket_path)
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    listener.bind(socket_path)
+    os.chmod(socket_path, int(options.mode, 8))
+    listener.listen(128)
+
+    children = set()
+
+    def shutdown(signum, frame):
+        raise KeyboardInterrupt
+
+    signal.signal(signal.SIGTERM, shutdown)
+
+    try:
+        while True:
+            while len(children) < options.workers:
+                children.add(spawn(listener, options))
+            pid, status = os.wait()
+            children.discard(pid)
+    except KeyboardInterrupt:
+        pass
+
+    for pid in children:
+        try:
+            os.kill(pid, signal.SIGTERM)
+        except OSError:
+            pass
+    os.unlink(socket_path)
+
+
+# ---------- Test client ------------
+
+#
+# Values from the Exim headers, as far as the test client is concerned
+#
+TEST_CONSTANTS = {
+    'LOG_MAIN': 1, 'LOG_PANIC': 2, 'LOG_REJECT': 16,
+    'LOCAL_SCAN_ACCEPT': 0, 'LOCAL_SCAN_ACCEPT_FREEZE': 1, 'LOCAL_SCAN_ACCEPT_QUEUE': 2,
+    'LOCAL_SCAN_REJECT': 7, 'LOCAL_SCAN_REJECT_NOLOGHDR': 8,
+    'LOCAL_SCAN_TEMPREJECT': 9, 'LOCAL_SCAN_TEMPREJECT_NOLOGHDR': 10,
+    'MESSAGE_ID_LENGTH': 16, 'SPOOL_DATA_START_OFFSET': 19, 'D_v': 1, 'D_local_scan': 2,
+    }
+
+def send_test_message(socket_path, message_file, recipients):
+    """
+    Act like Exim submitting a message for scanning: headers are
+    taken from the message file, the rest is passed as the spool fd.
+    """
+    f = open(message_file, 'rb')
+    headers = []
+    while True:
+        line = f.readline()
+        if line.strip() == b'':
+            break
+        if line[:1] in (b' ', b'\t') and headers:
+            headers[-1] += line
+        else:
+            headers.append(line)
+
+    os.lseek(f.fileno(), f.tell(), 0)
+
+    w = Writer()
+    for name in CONSTANTS:
+        w.int(TEST_CONSTANTS[name])
+    for name in INT_VARIABLES:
+        w.int(0)
+    for name in STRING_VARIABLES:
+        w.string({'message_id': 'test-message'}.get(name))
+    w.uint(len(headers))
+    for h in headers:
+        w.byte(b' ')
+        w.string(to_text(h))
+    w.uint(len(recipients))
+    for addr in recipients:
+        w.string(addr)
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(socket_path)
+    send_fd(sock, f.fileno())
+    send_frame(sock, b'R', w.getvalue())
+
+    while True:
+        frame_type, r = recv_frame(sock)
+        if frame_type == b'X':
+            s = r.string()
+            w = Writer()
+            w.byte(b'1')
+            w.string(s)
+            send_frame(sock, b'x', w.getvalue())
+        elif frame_type == b'L':
+            which = r.int()
+            print('log(%d): %s' % (which, r.string()))
+        elif frame_type == b'D':
+            print('debug: %s' % r.string().rstrip())
+        elif frame_type == b'E':
+            print('local_scan function failed:\n%s' % r.string())
+            return
+        elif frame_type == b'V':
+            print('rc: %d' % r.int())
+            print('return_text: %r' % r.string())
+            for i in range(r.uint()):
+                index = r.uint()
+                print('header %d type: %s' % (index, to_text(r.byte())))
+            for i in range(r.uint()):
+                htype = to_text(r.byte())
+                print('add header (%s): %s' % (htype, r.string().rstrip()))
+            for i in range(r.uint()):
+                print('remove recipient: %s' % recipients[r.uint()])
+            for i in range(r.uint()):
+                print('add recipient: %s' % r.string())
+            return
+        else:
+            raise ProtocolError('unexpected frame %r' % frame_type)
+
+
+def main():
+    parser = OptionParser(usage='%prog [options] <socket_path>')
+    parser.add_option('--path', action='append', default=[],
+        help='directory to append to sys.path, may be repeated')
+    parser.add_option('--module', default='exim_local_scan',
+        help='local_scan module to import [%default]')
+    parser.add_option('--function', default='local_scan',
+        help='function to call in that module [%default]')
+    parser.add_option('--exim-module', default='exim',
+        help='name of the module standing in for Exim\'s [%default]')
+    parser.add_option('--workers', type='int', default=0,
+        help='number of worker processes [number of CPUs]')
+    parser.add_option('--max-requests', type='int', default=0,
+        help='replace a worker after this many scans [never]')
+    parser.add_option('--scan-timeout', type='int', default=0,
+        help='kill a forked scanning process after this many seconds [never]')
+    parser.add_option('--expand-cache', action='store_true', default=False,
+        help='remember exim.expand() results for the rest of the message')
+    parser.add_option('--mode', default='660',
+        help='permissions for the socket, in octal [%default]')
+    parser.add_option('--send', metavar='MESSAGE_FILE',
+        help='instead of serving, submit MESSAGE_FILE to a running daemon for testing')
+    parser.add_option('--recipient', action='append', default=[],
+        help='envelope recipient for --send, may be repeated')
+
+    options, args = parser.parse_args()
+    if len(args) != 1:
+        parser.print_help()
+        sys.exit(1)
+
+    if options.send:
+        send_test_message(args[0], options.send, options.recipient)
+        return
+
+    if not options.workers:
+        try:
+            import multiprocessing
+            options.workers = multiprocessing.cpu_count()
+        except (ImportError, NotImplementedError):
+            options.workers = 1
+
+    serve(options, args[0])
+
+
+if __name__ == '__main__':
+    main()
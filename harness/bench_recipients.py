@@ -0,0 +1,22 @@
+"""
+Scan functions for timing what local_scan() does with Exim's list of
+recipients after the scan, on messages with many recipients:
+
+    expy_path=. expy_scan_module=bench_recipients expy_scan_function=untouched ./harness 6 5 10000
+    expy_path=. expy_scan_module=bench_recipients expy_scan_function=replace_list ./harness 6 5 10000
+
+replace_list assigns a new list to exim.recipients, dropping half the
+recipients and adding 100, which has local_scan() reconcile that list
+with the original one.
+"""
+import exim
+
+
+def untouched():
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def replace_list():
+    r = exim.recipients
+    exim.recipients = [a for i, a in enumerate(r) if i % 2] + ['new%d@example.com' % i for i in range(100)]
+    return exim.LOCAL_SCAN_ACCEPT
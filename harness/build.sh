@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Build ./harness from expy_local_scan.c and the stand-in Exim in this
+# directory, and ./callbench, both linked with the Python whose python-config is given in
+# $PYTHON_CONFIG (python2.7-config by default).
+# Extra arguments are passed to the compiler, for example
+#
+#    ./build.sh -DEXPY_NO_DSN
+#
+set -e
+cd "$(dirname "$0")"
+
+PYTHON_CONFIG=${PYTHON_CONFIG:-python2.7-config}
+CFLAGS="-g -O2 -Wall -Wno-pointer-sign -Wno-unused-function $($PYTHON_CONFIG --includes)"
+LIBDIR=$($PYTHON_CONFIG --prefix)/lib
+LIBS="-L$LIBDIR -Wl,-rpath,$LIBDIR $($PYTHON_CONFIG --libs)"
+
+cc $CFLAGS -I. -c ../expy_local_scan.c -o expy_local_scan.o "$@"
+cc $CFLAGS -I. -c exim_stub.c -o exim_stub.o
+cc $CFLAGS -I. -c harness.c -o harness.o
+cc -o harness harness.o exim_stub.o expy_local_scan.o $LIBS
+cc $CFLAGS -o callbench callbench.c $LIBS
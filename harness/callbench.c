@@ -0,0 +1,79 @@
+/*
+ * Times the ways local_scan() can call the scan function, on a trivial
+ * function defined in __main__ - see build.sh.
+ *
+ *    ./callbench [calls]
+ *
+ * Compares looking the function up in the module's dictionary for every
+ * call, as local_scan() once did, with using a reference kept from the
+ * import, and PyObject_CallFunction() with PyObject_Call() and an empty
+ * tuple made once, which is what local_scan() does now.
+ */
+
+#include <Python.h>
+#include <time.h>
+
+
+static double now(void)
+    {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+    }
+
+
+static void report(const char *what, double start, int calls)
+    {
+    printf("%-42s %6.1f ns/call\n", what, (now() - start) * 1e9 / calls);
+    }
+
+
+int main(int argc, char **argv)
+    {
+    int calls = (argc > 1) ? atoi(argv[1]) : 5000000;
+    PyObject *dict;
+    PyObject *func;
+    PyObject *empty;
+    PyObject *result;
+    double start;
+    int i;
+
+    Py_Initialize();
+    PyRun_SimpleString("def local_scan():\n    return 0\n");
+
+    dict = PyModule_GetDict(PyImport_AddModule("__main__"));  /* Borrowed reference */
+    empty = PyTuple_New(0);                                    /* New reference */
+
+    start = now();
+    for (i = 0; i < calls; i++)
+        {
+        func = PyMapping_GetItemString(dict, "local_scan");  /* New reference */
+        result = PyObject_CallFunction(func, NULL);           /* New reference */
+        Py_DECREF(result);
+        Py_DECREF(func);
+        }
+    report("lookup + PyObject_CallFunction(f, NULL)", start, calls);
+
+    func = PyDict_GetItemString(dict, "local_scan");  /* Borrowed reference */
+
+    start = now();
+    for (i = 0; i < calls; i++)
+        {
+        result = PyObject_CallFunction(func, NULL);  /* New reference */
+        Py_DECREF(result);
+        }
+    report("cached + PyObject_CallFunction(f, NULL)", start, calls);
+
+    start = now();
+    for (i = 0; i < calls; i++)
+        {
+        result = PyObject_Call(func, empty, NULL);  /* New reference */
+        Py_DECREF(result);
+        }
+    report("cached + PyObject_Call(f, empty, NULL)", start, calls);
+
+    Py_DECREF(empty);
+    Py_Finalize();
+    return 0;
+    }
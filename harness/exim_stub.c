@@ -0,0 +1,190 @@
+/*
+ * Just enough of Exim for harness.c to drive expy_local_scan.c:
+ * the globals local_scan() reads, and functions that behave roughly
+ * like Exim's.  expand_string() wraps its argument in <> (and fails
+ * on anything containing "fail"), and rfc2047_decode() replaces the
+ * first encoded-word with DECODED (and fails on "=?bad").
+ */
+
+#include <stdarg.h>
+#include <strings.h>
+#include "local_scan.h"
+
+int body_linecount = 3;
+int body_zerocount = 0;
+int debug_selector = 0;
+int host_checking = 0;
+int interface_port = 25;
+int sender_host_port = 4321;
+int recipients_count = 0;
+
+uschar *expand_string_message = NULL;
+uschar *headers_charset = US"UTF-8";
+uschar *interface_address = US"10.0.0.1";
+uschar *message_id = US"1abcde-000001-AB";
+uschar *received_protocol = US"esmtp";
+uschar *sender_address = US"Bob@Example.ORG";
+uschar *sender_host_address = US"192.0.2.1";
+uschar *sender_host_authenticated = NULL;
+uschar *sender_host_name = US"mx.example.org";
+
+header_line *header_list = NULL;
+header_line *header_last = NULL;
+recipient_item *recipients_list = NULL;
+
+static int recipients_size = 0;
+
+
+uschar *expand_string(uschar *s)
+    {
+    size_t n = strlen((char *)s);
+    uschar *result;
+
+    if (strstr((char *)s, "fail"))
+        {
+        expand_string_message = US"forced failure";
+        return NULL;
+        }
+
+    result = malloc(n + 3);
+    result[0] = '<';
+    memcpy(result + 1, s, n);
+    result[n + 1] = '>';
+    result[n + 2] = 0;
+    return result;
+    }
+
+
+void header_add(int type, const char *format, ...)
+    {
+    char buf[4096];
+    header_line *h;
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    h = calloc(1, sizeof(header_line));
+    h->type = type;
+    h->text = (uschar *)strdup(buf);
+    h->slen = strlen(buf);
+
+    if (header_last)
+        header_last->next = h;
+    else
+        header_list = h;
+    header_last = h;
+    }
+
+
+void log_write(unsigned int selector, int which, const char *format, ...)
+    {
+    va_list ap;
+
+    va_start(ap, format);
+    fprintf(stderr, "LOG[%d]: ", which);
+    vfprintf(stderr, format, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    }
+
+
+void debug_printf(const char *format, ...)
+    {
+    va_list ap;
+
+    if (!debug_selector)
+        return;
+
+    va_start(ap, format);
+    fprintf(stderr, "DEBUG: ");
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    }
+
+
+void receive_add_recipient(uschar *address, int pno)
+    {
+    recipient_item *r;
+
+    if (recipients_count >= recipients_size)
+        {
+        recipients_size = recipients_size ? recipients_size * 2 : 16;
+        recipients_list = realloc(recipients_list, recipients_size * sizeof(recipient_item));
+        }
+
+    r = &recipients_list[recipients_count++];
+    memset(r, 0, sizeof(recipient_item));
+    r->address = address;
+    r->pno = pno;
+    }
+
+
+void *store_get(int n, BOOL tainted)
+    {
+    return malloc(n);
+    }
+
+
+uschar *string_copy(const uschar *s)
+    {
+    return (uschar *)strdup((const char *)s);
+    }
+
+
+int strcmpic(const uschar *a, const uschar *b)
+    {
+    return strcasecmp((const char *)a, (const char *)b);
+    }
+
+
+pid_t child_open(uschar **argv, uschar **envp, int umask, int *infdptr, int *outfdptr, BOOL make_leader)
+    {
+    return -1;
+    }
+
+
+int child_close(pid_t pid, int timeout)
+    {
+    return 0;
+    }
+
+
+pid_t child_open_exim2(int *fd, uschar *sender, uschar *sender_authentication)
+    {
+    return -1;
+    }
+
+
+uschar *rfc2047_decode(uschar *s, BOOL lencheck, const uschar *target, int zeroval, int *lenptr, uschar **error)
+    {
+    char *start;
+    char *end;
+    uschar *result;
+
+    *error = NULL;
+    if (strstr((char *)s, "=?bad"))
+        {
+        *error = US"bad charset";
+        return NULL;
+        }
+
+    start = strstr((char *)s, "=?");
+    if (!start)
+        {
+        if (lenptr)
+            *lenptr = strlen((char *)s);
+        return s;
+        }
+
+    end = strstr(start + 2, "?=");
+    result = malloc(strlen((char *)s) + 16);
+    memcpy(result, s, start - (char *)s);
+    strcpy((char *)result + (start - (char *)s), "DECODED");
+    strcat((char *)result, end ? end + 2 : "");
+
+    if (lenptr)
+        *lenptr = strlen((char *)result);
+    return result;
+    }
@@ -0,0 +1,168 @@
+/*
+ * Runs messages through expy_local_scan.c's local_scan() without Exim,
+ * for testing and benchmarking - see build.sh.
+ *
+ *    ./harness [messages [headers [recipients]]]
+ *
+ * The local_scan options are taken from environment variables of the
+ * same names, for example
+ *
+ *    expy_path=. expy_scan_module=bench_recipients expy_scan_function=untouched ./harness 100 5 10000
+ *
+ * Each message gets the given number of headers and recipients, the
+ * first recipient having pno, errors_to and DSN fields set.  With 5
+ * messages or fewer, the result of each scan is printed (recipients
+ * with their fields in [errors_to,pno,dsn_flags,orcpt] when they have
+ * any, and headers with a type other than ' '), otherwise just the time
+ * taken.  Exim's log lines go to stderr.
+ *
+ * HARNESS_FORK=1 scans each message in a forked child, HARNESS_FD sets
+ * the fd passed to local_scan(), and HARNESS_SLEEP_MS sleeps that long
+ * between messages.  With HARNESS_FORK set, an extra -bd argument makes
+ * the harness look like the Exim daemon to expy_preload.
+ */
+
+#include "local_scan.h"
+#include <time.h>
+#include <sys/wait.h>
+
+extern int local_scan(int, uschar **);
+extern optionlist local_scan_options[];
+extern int local_scan_options_count;
+
+
+static void set_options(void)
+    {
+    int i;
+
+    for (i = 0; i < local_scan_options_count; i++)
+        {
+        optionlist *o = &local_scan_options[i];
+        char *value = getenv(o->name);
+
+        if (!value)
+            continue;
+
+        if (o->type == opt_bool)
+            *(BOOL *)o->value = !strcmp(value, "true");
+        else if (o->type == opt_stringptr)
+            *(uschar **)o->value = (uschar *)value;
+        else
+            *(int *)o->value = atoi(value);
+        }
+    }
+
+
+static void new_message(int headers, int recipients)
+    {
+    char buf[64];
+    int i;
+
+    header_list = header_last = NULL;
+    recipients_count = 0;
+
+    for (i = 0; i < headers; i++)
+        header_add(' ', i ? "X-Header-%d: value\n" : "Subject: hello %d\n", i);
+
+    for (i = 0; i < recipients; i++)
+        {
+        sprintf(buf, "user%d@Dom%d.example", i, i % 7);
+        receive_add_recipient(string_copy(US buf), -1);
+        }
+
+    if (recipients)
+        {
+        recipients_list[0].pno = 3;
+        recipients_list[0].errors_to = US"bounce@Dom0.example";
+        recipients_list[0].dsn_flags = 7;
+        recipients_list[0].orcpt = US"rfc822;user0@Dom0.example";
+        }
+    }
+
+
+static void print_result(int rc, uschar *return_text)
+    {
+    header_line *h;
+    int i;
+
+    printf("rc=%d text=%s rcpts=%d:", rc, return_text ? (char *)return_text : "-", recipients_count);
+    for (i = 0; (i < recipients_count) && (i < 10); i++)
+        {
+        recipient_item *r = &recipients_list[i];
+
+        printf(" %s", r->address);
+        if (r->errors_to || (r->pno != -1) || r->dsn_flags || r->orcpt)
+            printf("[%s,%d,%d,%s]", r->errors_to ? (char *)r->errors_to : "-", r->pno,
+                   r->dsn_flags, r->orcpt ? (char *)r->orcpt : "-");
+        }
+    printf("\n");
+
+    for (h = header_list; h; h = h->next)
+        if (h->type != ' ')
+            printf("  hdr %c %s", h->type, h->text);
+
+    fflush(stdout);
+    }
+
+
+static double now(void)
+    {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+    }
+
+
+int main(int argc, char **argv)
+    {
+    int messages = (argc > 1) ? atoi(argv[1]) : 3;
+    int headers = (argc > 2) ? atoi(argv[2]) : 5;
+    int recipients = (argc > 3) ? atoi(argv[3]) : 3;
+    int forking = getenv("HARNESS_FORK") != NULL;
+    int fd = getenv("HARNESS_FD") ? atoi(getenv("HARNESS_FD")) : 0;
+    double start;
+    int m;
+
+    set_options();
+    start = now();
+
+    for (m = 0; m < messages; m++)
+        {
+        uschar *return_text = NULL;
+        pid_t pid = 0;
+        int rc;
+
+        if (forking)
+            {
+            pid = fork();
+
+            if (pid)
+                {
+                int status;
+
+                waitpid(pid, &status, 0);
+                }
+            }
+
+        if (!pid)
+            {
+            new_message(headers, recipients);
+            rc = local_scan(fd, &return_text);
+
+            if (messages <= 5)
+                print_result(rc, return_text);
+
+            if (forking)
+                _exit(0);
+            }
+
+        if (getenv("HARNESS_SLEEP_MS"))
+            usleep(atoi(getenv("HARNESS_SLEEP_MS")) * 1000);
+        }
+
+    if (messages > 5)
+        printf("%d messages in %.3fs (%.2fus/msg)\n", messages, now() - start, (now() - start) * 1e6 / messages);
+
+    return 0;
+    }
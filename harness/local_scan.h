@@ -0,0 +1,89 @@
+/*
+ * Stand-in for the parts of Exim's local_scan.h that expy_local_scan.c
+ * uses, so it can be built and run outside Exim by harness.c.  This
+ * is NOT Exim's header - build the real thing against Exim's own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+typedef unsigned char uschar;
+typedef int BOOL;
+
+#define TRUE    1
+#define FALSE   0
+#define US      (unsigned char *)
+#define CS      (char *)
+
+typedef struct
+    {
+    const char *name;
+    int type;
+    void *value;
+    } optionlist;
+
+#define opt_stringptr   0
+#define opt_int         1
+#define opt_time        7
+#define opt_bool        10
+
+#define LOCAL_SCAN_ACCEPT               0
+#define LOCAL_SCAN_ACCEPT_FREEZE        1
+#define LOCAL_SCAN_ACCEPT_QUEUE         2
+#define LOCAL_SCAN_REJECT               7
+#define LOCAL_SCAN_REJECT_NOLOGHDR      8
+#define LOCAL_SCAN_TEMPREJECT           9
+#define LOCAL_SCAN_TEMPREJECT_NOLOGHDR  10
+
+#define LOG_MAIN    1
+#define LOG_PANIC   2
+#define LOG_REJECT  16
+
+#define MESSAGE_ID_LENGTH        16
+#define SPOOL_DATA_START_OFFSET  (MESSAGE_ID_LENGTH+3)
+
+#define D_v           0x1
+#define D_local_scan  0x2
+
+typedef struct header_line
+    {
+    struct header_line *next;
+    int type;
+    int slen;
+    uschar *text;
+    } header_line;
+
+typedef struct recipient_item
+    {
+    uschar *address;
+    int pno;
+    uschar *errors_to;
+    uschar *orcpt;
+    int dsn_flags;
+    } recipient_item;
+
+extern int body_linecount, body_zerocount, debug_selector, host_checking;
+extern int interface_port, sender_host_port, recipients_count;
+extern uschar *expand_string_message, *headers_charset, *interface_address;
+extern uschar *message_id, *received_protocol, *sender_address;
+extern uschar *sender_host_address, *sender_host_authenticated, *sender_host_name;
+extern header_line *header_list, *header_last;
+extern recipient_item *recipients_list;
+
+extern uschar *expand_string(uschar *);
+extern void header_add(int, const char *, ...);
+extern void log_write(unsigned int, int, const char *, ...);
+extern void debug_printf(const char *, ...);
+extern void receive_add_recipient(uschar *, int);
+extern void *store_get(int, BOOL);
+extern uschar *string_copy(const uschar *);
+extern int strcmpic(const uschar *, const uschar *);
+extern pid_t child_open(uschar **, uschar **, int, int *, int *, BOOL);
+extern int child_close(pid_t, int);
+extern pid_t child_open_exim2(int *, uschar *, uschar *);
+extern uschar *rfc2047_decode(uschar *, BOOL, const uschar *, int, int *, uschar **);
+
+#define Ustrlen(s) strlen(CS(s))
@@ -0,0 +1,87 @@
+"""
+Scan functions for test_message.py, each run on a message with the
+headers "Subject: hello 0", "X-Header-1: value" and "X-Header-2: value",
+returning what they found as the return text.
+"""
+import exim
+
+
+def objects_made():
+    stats = exim.stats()
+    return stats['header_objects_allocated'] + stats['header_objects_reused']
+
+
+def header_indexing():
+    made = objects_made()
+    h = exim.headers
+    n = len(h)
+    after_len = objects_made() - made
+    last = h[-1]
+    after_one = objects_made() - made
+    names = [x.name for x in h[1:]]
+    return exim.LOCAL_SCAN_ACCEPT, '%d %d %d %s %s' % (n, after_len, after_one, h[-1] is last, ','.join(names))
+
+
+def header_fields():
+    h = exim.headers[0]
+    seen = [repr(h.text), h.name, h.value, h.value is h.value, repr(h.type)]
+    h.type = '*'
+    seen += [exim.get_header('SUBJECT'), len(exim.get_headers('x-header-1'))]
+    try:
+        h.type = 'xx'
+    except TypeError:
+        seen.append('TypeError')
+    return exim.LOCAL_SCAN_ACCEPT, ' '.join(str(x) for x in seen)
+
+
+def added_headers():
+    exim.get_header('subject')  # index the headers before adding one
+    exim.add_header('X-Added: yes')
+    h = exim.headers
+    return exim.LOCAL_SCAN_ACCEPT, '%d %s %s' % (len(h), h[-1].name, exim.get_header('x-added').value)
+
+
+def decoded():
+    exim.add_header('X-Enc: =?UTF-8?Q?abc?= tail')
+    exim.add_header('X-Bad: =?bad?Q?abc?=')
+    seen = [exim.get_header('x-enc').decoded, exim.get_header('x-bad').decoded,
+            exim.decode_header('plain')]
+    try:
+        exim.decode_header('=?bad?Q?abc?=')
+    except ValueError:
+        seen.append('ValueError')
+    return exim.LOCAL_SCAN_ACCEPT, ' | '.join(seen)
+
+
+def var_lookup():
+    # The stand-in expand_string() returns its argument in <>, so
+    # anything that went through it shows
+    seen = [exim.var('message_id'), exim.var('interface_port'), exim.var('tls_in_cipher'),
+            exim.var('tls_in_cipher') is exim.var('tls_in_cipher')]
+    try:
+        exim.var('no such')
+    except ValueError:
+        seen.append('ValueError')
+    try:
+        exim.var('fail_me')
+    except exim.ExpansionError:
+        seen.append('ExpansionError')
+    return exim.LOCAL_SCAN_ACCEPT, ' '.join(str(x) for x in seen)
+
+
+def expand_many():
+    first = exim.expand_many(['a', 'fail'])
+    stats = exim.stats()
+    again = exim.expand_many({'x': 'a'})
+    hits = exim.stats()['expand_cache_hits'] - stats['expand_cache_hits']
+    return exim.LOCAL_SCAN_ACCEPT, '%s %s %s %d' % (first['a'], type(first['fail']).__name__, again['x'], hits)
+
+
+def scan_context(msg):
+    seen = [msg.message_id, msg.sender_domain_lower, msg.tls_in_cipher, hasattr(exim, 'message_id')]
+    try:
+        msg.fail_me
+    except AttributeError:
+        seen.append('AttributeError')
+    return exim.LOCAL_SCAN_ACCEPT, ' '.join(str(x) for x in seen)
+
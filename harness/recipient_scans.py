@@ -0,0 +1,108 @@
+"""
+Scan functions for test_recipients.py, each run on a message with the
+recipients user0@Dom0.example .. user3@Dom3.example, the first of
+which has pno, errors_to and DSN fields set.
+"""
+import exim
+
+
+def slice_filter():
+    r = exim.recipients
+    r[:] = [a for a in r if a != 'user1@Dom1.example']
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def slice_reorder():
+    r = exim.recipients
+    r[:] = ['user2@Dom2.example', 'user0@Dom0.example', 'new@example.com']
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def slice_tail():
+    r = exim.recipients
+    r[2:] = ['user3@Dom3.example', 'new@example.com']
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def slice_bad_item():
+    r = exim.recipients
+    try:
+        r[:] = ['new@example.com', 5]
+    except TypeError:
+        pass
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def slice_then_fail():
+    exim.recipients[:] = ['new@example.com']
+    raise ValueError('scan failed')
+
+
+def replace_item():
+    exim.recipients[0] = 'moved@example.com'
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def replace_list():
+    exim.recipients = [a for a in exim.recipients if a != 'user1@Dom1.example']
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def count_follows_changes():
+    r = exim.recipients
+    seen = [exim.var('recipients_count')]
+    r.append('new@example.com')
+    seen.append(exim.var('recipients_count'))
+    del r[0]
+    r.remove('user1@Dom1.example')
+    seen.append(exim.var('recipients_count'))
+    r.remove_many(['user2@Dom2.example'])
+    seen.append(exim.var('recipients_count'))
+    return exim.LOCAL_SCAN_ACCEPT, ' '.join(seen)
+
+
+def expansions_follow_changes():
+    # The stand-in expand_string() doesn't know about recipients, so
+    # count its calls instead: each change has to go back to Exim
+    r = exim.recipients
+    first = exim.expand('$recipients')
+    again = exim.expand('$recipients')
+    r.append('new@example.com')
+    stats = exim.stats()
+    after = exim.expand('$recipients')
+    misses = exim.stats()['expand_cache_misses'] - stats['expand_cache_misses']
+    return exim.LOCAL_SCAN_ACCEPT, '%s %s %d' % (first == again, after == first, misses)
+
+
+def list_operators():
+    # Things that worked when exim.recipients was a plain list
+    r = exim.recipients
+    added = r + ['new@example.com']
+    before = ['new@example.com'] + r
+    seen = [type(added).__name__, len(added), before[0], r == list(r), r != list(r),
+            r == list(r)[:-1], r == tuple(r), r[::-2] == list(r)[::-2], len(r * 2)]
+    return exim.LOCAL_SCAN_ACCEPT, ' '.join(str(x) for x in seen)
+
+
+def sort_reverse_insert():
+    r = exim.recipients
+    r.reverse()
+    r.sort(key=lambda a: a.startswith('user3'))
+    r.insert(1, 'new@example.com')
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def add_many_string():
+    try:
+        exim.recipients.add_many('new@example.com')
+    except TypeError:
+        pass
+    return exim.LOCAL_SCAN_ACCEPT
+
+
+def add_many_bad_item():
+    try:
+        exim.recipients.add_many(['new@example.com', 5])
+    except TypeError:
+        pass
+    return exim.LOCAL_SCAN_ACCEPT
@@ -0,0 +1,130 @@
+#!/usr/bin/env python
+"""
+Check what the scan functions in message_scans.py see of the message -
+its headers, exim.var(), exim.expand_many() and the scan context - and
+that a scan module can be loaded from an expy_bundle archive or an
+expy_code_cache file, using the harness built by build.sh.  Prints each
+result and exits non-zero if any don't match.
+
+The bundle and code cache are made with make_expy_bundle.py, run with
+$PYTHON (python2.7 by default) since it has to be the Python the harness
+embeds; those tests are skipped if that can't be run.
+"""
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+from test_recipients import HERE, run
+
+PYTHON = os.environ.get('PYTHON', 'python2.7')
+
+EXPECTED = [
+    # len() doesn't make header objects, indexing makes only the one
+    # asked for and keeps it
+    ('header_indexing', {}, '3 0 1 True x-header-1,x-header-2'),
+    # A header marked deleted isn't found by name, and a type has to
+    # be one character
+    ('header_fields', {}, "'Subject: hello 0\\n' subject hello 0 True ' ' None 1 TypeError"),
+    # Headers added during the scan show up at the end
+    ('added_headers', {}, '4 x-added yes'),
+    # .decoded falls back to the raw value if decoding fails
+    ('decoded', {}, 'DECODED tail | =?bad?Q?abc?= | plain | ValueError'),
+    # var() reads message_id and interface_port itself, expands
+    # tls_in_cipher, and remembers what it expanded
+    ('var_lookup', {}, '1abcde-000001-AB 25 <$tls_in_cipher> True ValueError ExpansionError'),
+    # A second expand_many() of the same string is only a cache hit
+    # when expy_expand_cache is set
+    ('expand_many', {}, '<a> ExpansionError <a> 1'),
+    ('expand_many', {'expy_expand_cache': 'false'}, '<a> ExpansionError <a> 0'),
+    ('scan_context', {'expy_scan_context': 'true'},
+     '1abcde-000001-AB example.org <$tls_in_cipher> False AttributeError'),
+    ]
+
+LOADED = '''\
+import sys
+import exim
+
+
+def local_scan():
+    return exim.LOCAL_SCAN_ACCEPT, '%s %s' % ('.zip' in __file__, __loader__ in sys.meta_path)
+'''
+
+# Module, options and expected return text for each of the ways
+# make_expy_bundle.py packages a scan module
+PACKAGED = [
+    ('loaded_bundle', lambda path: {'expy_bundle': path}, 'True False'),
+    ('loaded_cache', lambda path: {'expy_code_cache': path}, 'False True'),
+    ]
+
+
+def text_of(got):
+    """
+    The return text from the harness's output
+    """
+    match = re.match(r'rc=\d+ text=(.*) rcpts=\d+:', got)
+    return match and match.group(1)
+
+
+def check(name, expected, got, log):
+    if text_of(got) == expected:
+        print('ok      %s' % name)
+        return 0
+    print('FAILED  %s\n    expected: %s\n    got:      %s\n%s' % (name, expected, got, log))
+    return 1
+
+
+def check_packaged():
+    failed = 0
+    tmp = tempfile.mkdtemp()
+    devnull = open(os.devnull, 'w')
+    try:
+        for module, options, expected in PACKAGED:
+            source = os.path.join(tmp, module + '.py')
+            with open(source, 'w') as f:
+                f.write(LOADED)
+            if module == 'loaded_bundle':
+                path = os.path.join(tmp, module + '.zip')
+                args = [path, source]
+            else:
+                path = os.path.join(tmp, module + '.cache')
+                args = ['--cache', path, source]
+            try:
+                rc = subprocess.call([PYTHON, os.path.join(HERE, '..', 'make_expy_bundle.py')] + args,
+                                     stdout=devnull, stderr=devnull)
+            except OSError:
+                rc = 127
+            if rc == 127:
+                print('skipped %s (no %s)' % (module, PYTHON))
+                continue
+            if rc:
+                failed += 1
+                print('FAILED  %s (make_expy_bundle.py exited %d)' % (module, rc))
+                continue
+            if module == 'loaded_bundle':
+                # Only the archive should have the module
+                os.remove(source)
+            got, log = run('local_scan', module, expy_path=tmp, **options(path))
+            failed += check(module, expected, got, log)
+    finally:
+        devnull.close()
+        shutil.rmtree(tmp)
+    return failed
+
+
+def main():
+    failed = 0
+    for function, options, expected in EXPECTED:
+        got, log = run(function, 'message_scans', headers=3, **options)
+        name = function
+        if options:
+            name += ' ' + ' '.join('%s=%s' % option for option in sorted(options.items()))
+        failed += check(name, expected, got, log)
+    failed += check_packaged()
+    return failed and 1 or 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+"""
+Check what the scan functions in recipient_scans.py leave in Exim's
+recipients list, using the harness built by build.sh.  Prints each
+result and exits non-zero if any don't match.
+"""
+import os
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+USER0 = 'user0@Dom0.example[bounce@Dom0.example,3,7,rfc822;user0@Dom0.example]'
+USER1 = 'user1@Dom1.example'
+USER2 = 'user2@Dom2.example'
+USER3 = 'user3@Dom3.example'
+MOVED = 'moved@example.com[bounce@Dom0.example,3,7,rfc822;user0@Dom0.example]'
+NEW = 'new@example.com'
+
+EXPECTED = [
+    # Survivors of a slice assignment keep their recipient_item...
+    ('slice_filter', 0, [USER0, USER2, USER3]),
+    # ...even out of order, when they're copied to the end
+    ('slice_reorder', 0, [USER2, USER0, NEW]),
+    ('slice_tail', 0, [USER0, USER1, USER3, NEW]),
+    # A bad item leaves the list alone
+    ('slice_bad_item', 0, [USER0, USER1, USER2, USER3]),
+    # So does a scan that fails (rc 9 is expy_scan_failure's default, tempreject)
+    ('slice_then_fail', 9, [USER0, USER1, USER2, USER3]),
+    ('replace_item', 0, [USER1, USER2, USER3, MOVED]),
+    ('replace_list', 0, [USER0, USER2, USER3]),
+    # Exim's recipients_count doesn't change until the scan is done,
+    # but exim.var('recipients_count') has to
+    ('count_follows_changes', 0, '4 5 3 2', [USER3, NEW]),
+    # Remembered expansions are forgotten when the list changes
+    ('expansions_follow_changes', 0, 'True True 1', [USER0, USER1, USER2, USER3, NEW]),
+    # Operators that worked when exim.recipients was a list still do...
+    ('list_operators', 0, 'list 5 new@example.com True False False False True 8', [USER0, USER1, USER2, USER3]),
+    # ...and reordering keeps each recipient's fields
+    ('sort_reverse_insert', 0, [USER2, NEW, USER1, USER0, USER3]),
+    # add_many() won't take a string's characters as addresses, and
+    # adds nothing if any item is bad
+    ('add_many_string', 0, [USER0, USER1, USER2, USER3]),
+    ('add_many_bad_item', 0, [USER0, USER1, USER2, USER3]),
+    ]
+
+
+def run(function, module='recipient_scans', headers=2, **options):
+    """
+    Scan one message with the given function, with local_scan options
+    from the keyword arguments, returning the harness's output and log
+    """
+    env = dict(os.environ)
+    env.update({
+        'expy_path': HERE,
+        'expy_scan_module': module,
+        'expy_scan_function': function,
+        'expy_expand_cache': 'true',
+        })
+    env.update(options)
+    p = subprocess.Popen([os.path.join(HERE, 'harness'), '1', str(headers), '4'],
+                         env=env, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = p.communicate()
+    return out.decode('utf-8').strip(), err.decode('utf-8').strip()
+
+
+def main():
+    failed = 0
+    for test in EXPECTED:
+        if len(test) == 4:
+            function, rc, text, recipients = test
+        else:
+            function, rc, recipients = test
+            text = 'Internal error' if rc == 9 else '-'
+        expected = 'rc=%d text=%s rcpts=%d: %s' % (rc, text, len(recipients), ' '.join(recipients))
+        got, log = run(function)
+        if got == expected:
+            print('ok      %s' % function)
+        else:
+            failed += 1
+            print('FAILED  %s\n    expected: %s\n    got:      %s\n%s' % (function, expected, got, log))
+    return failed and 1 or 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,133 @@
+#!/usr/bin/env python2
+"""
+Build a single zip archive holding precompiled copies of your local_scan
+module and whatever other modules and packages it needs, for use with
+the expy_bundle setting in the Exim configure file.
+
+With --cache, build a code cache file for the expy_code_cache setting
+instead: the compiled code of each module along with its source file's
+path and modification time, laid out so Exim can use it straight
+from a shared memory mapping.
+
+Run this with the same version of Python that Exim is linked with,
+since the archive holds bytecode compiled by the Python running
+this script.  The archive is written under a temporary name and
+then renamed into place, so Exim never sees a half-written one.
+Modules are stored uncompressed, so importing them is just a matter
+of reading them out of the archive.
+
+"""
+import imp
+import marshal
+import os
+import os.path
+import struct
+import sys
+import zipfile
+
+
+CACHE_MAGIC = b'EXPYCC1\0'
+CACHE_PACKAGE = 1
+
+
+def make_bundle(bundle_name, sources):
+    tmp_name = '%s.%d.tmp' % (bundle_name, os.getpid())
+
+    bundle = zipfile.PyZipFile(tmp_name, 'w', zipfile.ZIP_STORED)
+    try:
+        for source in sources:
+            source = os.path.abspath(source)
+            if not os.path.exists(source):
+                raise IOError('No such file or directory: %s' % source)
+            bundle.writepy(source)
+    except:
+        bundle.close()
+        os.unlink(tmp_name)
+        raise
+
+    names = bundle.namelist()
+    bundle.close()
+
+    os.rename(tmp_name, bundle_name)
+    return names
+
+
+def find_modules(source, prefix=''):
+    """
+    Yield (module name, source path, is package) for a module
+    file, or a package directory and everything inside it
+    """
+    source = os.path.abspath(source)
+    name = prefix + os.path.splitext(os.path.basename(source))[0]
+
+    if os.path.isdir(source):
+        init = os.path.join(source, '__init__.py')
+        if not os.path.exists(init):
+            raise IOError('Not a package: %s' % source)
+        yield name, init, True
+        for entry in sorted(os.listdir(source)):
+            path = os.path.join(source, entry)
+            if entry == '__init__.py':
+                continue
+            if entry.endswith('.py') or os.path.exists(os.path.join(path, '__init__.py')):
+                for result in find_modules(path, name + '.'):
+                    yield result
+    elif source.endswith('.py'):
+        yield name, source, False
+    else:
+        raise IOError('Not a Python module or package: %s' % source)
+
+
+def make_cache(cache_name, sources):
+    entries = []
+    for source in sources:
+        for name, path, is_package in find_modules(source):
+            f = open(path, 'rU')
+            code = compile(f.read(), path, 'exec')
+            f.close()
+            entries.append((name, path, is_package, int(os.stat(path).st_mtime), marshal.dumps(code)))
+
+    header_size = 16
+    entry_size = 32
+    offset = header_size + entry_size * len(entries)
+
+    index = [CACHE_MAGIC, imp.get_magic()[:4], struct.pack('<I', len(entries))]
+    blobs = []
+    for name, path, is_package, mtime, code in entries:
+        name = name.encode('utf-8')
+        path = path.encode(sys.getfilesystemencoding() or 'utf-8')
+        flags = is_package and CACHE_PACKAGE or 0
+
+        index.append(struct.pack('<8I',
+            offset, len(name),
+            offset + len(name), len(path),
+            flags, mtime & 0xffffffff,
+            offset + len(name) + len(path), len(code)))
+        blobs.extend([name, path, code])
+        offset += len(name) + len(path) + len(code)
+
+    tmp_name = '%s.%d.tmp' % (cache_name, os.getpid())
+    f = open(tmp_name, 'wb')
+    f.write(b''.join(index + blobs))
+    f.close()
+    os.rename(tmp_name, cache_name)
+
+    return [e[0] for e in entries]
+
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    build = make_bundle
+    if args and args[0] == '--cache':
+        build = make_cache
+        args = args[1:]
+
+    if len(args) < 2:
+        sys.stdout.write('Build a bundle of precompiled Python modules for expy_bundle\n')
+        sys.stdout.write('    Usage: %s <bundle.zip> <module.py or package_dir> ...\n' % sys.argv[0])
+        sys.stdout.write('Or a code cache for expy_code_cache\n')
+        sys.stdout.write('    Usage: %s --cache <cache_file> <module.py or package_dir> ...\n' % sys.argv[0])
+        sys.exit(1)
+
+    for name in build(args[0], args[1:]):
+        sys.stdout.write('    %s\n' % name)